@@ -0,0 +1,116 @@
+/*
+ *  cpp_binder: an automatic C++ binding generator for D
+ *  Copyright (C) 2016 Paul O'Neil <redballoon36@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times the binder::string operations that the traversal and the
+// configuration pass do the most of.  Run it as
+//   string_bench [iterations]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "string.hpp"
+
+// Names shaped like the ones in the LLVM headers
+static const char* const names[] = {
+    "int", "size_t", "Value", "getName", "iterator", "begin", "end",
+    "StringRef", "ArrayRef", "DenseMapInfo", "getCanonicalDecl",
+    "ImmutableCallSite", "TargetTransformInfoWrapperPass",
+};
+static const size_t name_count = sizeof(names) / sizeof(names[0]);
+
+// Keeps the compiler from throwing the work away
+static size_t sink = 0;
+
+template<typename Operation>
+static void measure(const char* label, size_t iterations, Operation operation)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx < iterations; ++idx)
+    {
+        operation(idx);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::cout << label << ": " << ns / iterations << " ns\n";
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = 1000000;
+    if (argc > 1)
+    {
+        iterations = std::strtoul(argv[1], nullptr, 10);
+    }
+    if (iterations == 0)
+    {
+        std::cerr << "usage: " << argv[0] << " [iterations]\n";
+        return 1;
+    }
+
+    std::vector<binder::string> strings;
+    for (size_t idx = 0; idx < name_count; ++idx)
+    {
+        strings.emplace_back(names[idx]);
+    }
+
+    measure("construct a name", iterations, [&](size_t idx) {
+        binder::string name(names[idx % name_count]);
+        sink += name.size();
+    });
+
+    measure("copy a name", iterations, [&](size_t idx) {
+        binder::string name(strings[idx % name_count]);
+        sink += name.size();
+    });
+
+    measure("compare names", iterations, [&](size_t idx) {
+        sink += strings[idx % name_count] == strings[(idx + 1) % name_count];
+    });
+
+    measure("hash a name", iterations, [&](size_t idx) {
+        sink += std::hash<binder::string>()(strings[idx % name_count]);
+    });
+
+    measure("qualified name with +=", iterations / 10, [&](size_t idx) {
+        binder::string qualified;
+        for (size_t part = 0; part < 8; ++part)
+        {
+            qualified += strings[(idx + part) % name_count];
+            qualified += binder::string("::");
+        }
+        sink += qualified.size();
+    });
+
+    measure("qualified name with string_builder", iterations / 10, [&](size_t idx) {
+        binder::string_builder qualified;
+        for (size_t part = 0; part < 8; ++part)
+        {
+            qualified.append(strings[(idx + part) % name_count]).append("::", 2);
+        }
+        sink += qualified.finish().size();
+    });
+
+    measure("intern a name", iterations, [&](size_t idx) {
+        sink += binder::intern(strings[idx % name_count])->size();
+    });
+
+    std::cerr << sink % 2 << "\n";
+    return 0;
+}
@@ -16,21 +16,288 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "clang/Basic/VirtualFileSystem.h"
 #include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "clang/Serialization/ASTReader.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 #include "clang_wrapper.hpp"
 
-clang::ASTUnit* buildAST(char * contents, size_t arg_len, char** raw_args, char * filename)
+namespace
 {
-    std::vector<std::string> clang_args;
-    clang_args.resize(arg_len);
+    // The ASTReader keeps a reference to the container reader for as long
+    // as the ASTUnit lives, so it cannot be a temporary.
+    std::shared_ptr<clang::PCHContainerOperations> pchOperations()
+    {
+        static std::shared_ptr<clang::PCHContainerOperations> pch_operations =
+            std::make_shared<clang::PCHContainerOperations>();
+        return pch_operations;
+    }
+
+    // Every file clang read to build ast.  The source manager only knows
+    // about the files that were parsed; the ones behind a precompiled
+    // header or AST file are listed by the AST reader.
+    std::vector<const clang::FileEntry*> filesInAST(clang::ASTUnit* ast)
+    {
+        std::set<const clang::FileEntry*> files;
+        const clang::SourceManager& sources = ast->getSourceManager();
+        for (auto entry = sources.fileinfo_begin(); entry != sources.fileinfo_end(); ++entry)
+        {
+            files.insert(entry->first);
+        }
+
+        clang::IntrusiveRefCntPtr<clang::ASTReader> reader = ast->getASTReader();
+        if (reader)
+        {
+            for (clang::serialization::ModuleFile* module : reader->getModuleManager())
+            {
+                reader->visitInputFiles(*module, /*IncludeSystem=*/true, /*Complain=*/false,
+                    [&files](const clang::serialization::InputFile& input, bool)
+                    {
+                        if (input.getFile())
+                        {
+                            files.insert(input.getFile());
+                        }
+                    });
+            }
+        }
+        return std::vector<const clang::FileEntry*>(files.begin(), files.end());
+    }
+
+    // Does the same thing as the action inside
+    // clang::tooling::buildASTFromCodeWithArgs, but lets us adjust the
+    // frontend options before clang runs.
+    class ASTBuilderAction : public clang::tooling::ToolAction
+    {
+        std::unique_ptr<clang::ASTUnit>& result;
+        bool declarations_only;
+
+        public:
+        ASTBuilderAction(std::unique_ptr<clang::ASTUnit>& r, bool decls_only)
+            : result(r), declarations_only(decls_only)
+        { }
+
+        virtual bool runInvocation(clang::CompilerInvocation* invocation,
+                                   clang::FileManager* files,
+                                   std::shared_ptr<clang::PCHContainerOperations> pch_operations,
+                                   clang::DiagnosticConsumer* diagnostic_consumer) override
+        {
+            clang::TranslationUnitKind tu_kind = clang::TU_Complete;
+            if (declarations_only)
+            {
+                // We never look inside function bodies
+                invocation->getFrontendOpts().SkipFunctionBodies = true;
+                // A prefix TU skips the implicit instantiations performed
+                // at the end of a complete TU.  Those are all function
+                // definitions, which we would skip anyway.  Class templates
+                // are still instantiated wherever a declaration needs them.
+                tu_kind = clang::TU_Prefix;
+                invocation->getDiagnosticOpts().IgnoreWarnings = true;
+            }
+
+            clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diagnostics =
+                clang::CompilerInstance::createDiagnostics(&invocation->getDiagnosticOpts(),
+                                                           diagnostic_consumer,
+                                                           /*ShouldOwnClient=*/false);
+            result = clang::ASTUnit::LoadFromCompilerInvocation(invocation,
+                                                                pch_operations,
+                                                                diagnostics,
+                                                                files,
+                                                                /*OnlyLocalDecls=*/false,
+                                                                /*CaptureDiagnostics=*/false,
+                                                                /*PrecompilePreamble=*/false,
+                                                                tu_kind);
+            return result != nullptr;
+        }
+    };
+}
+
+clang::ASTUnit* buildAST(char * contents, size_t arg_len, char** raw_args, char * filename,
+                         size_t file_count, char** file_names, char** file_contents, std::time_t* file_times,
+                         bool declarations_only)
+{
+    std::vector<std::string> command_line;
+    command_line.reserve(arg_len + 3);
+    command_line.emplace_back("cpp_binder");
+    command_line.emplace_back("-fsyntax-only");
     for (size_t i = 0; i < arg_len; ++i)
     {
-        clang_args.at(i) = raw_args[i];
+        command_line.emplace_back(raw_args[i]);
+    }
+    command_line.emplace_back(filename);
+
+    // The umbrella source only exists in memory, and any other files we
+    // were given shadow the ones on disk.
+    llvm::IntrusiveRefCntPtr<clang::vfs::OverlayFileSystem> overlay_fs(
+        new clang::vfs::OverlayFileSystem(clang::vfs::getRealFileSystem()));
+    llvm::IntrusiveRefCntPtr<clang::vfs::InMemoryFileSystem> memory_fs(
+        new clang::vfs::InMemoryFileSystem);
+    overlay_fs->pushOverlay(memory_fs);
+    memory_fs->addFile(filename, 0, llvm::MemoryBuffer::getMemBufferCopy(contents));
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        memory_fs->addFile(file_names[i], file_times[i],
+                           llvm::MemoryBuffer::getMemBufferCopy(file_contents[i], file_names[i]));
+    }
+    llvm::IntrusiveRefCntPtr<clang::FileManager> files(
+        new clang::FileManager(clang::FileSystemOptions(), overlay_fs));
+
+    std::unique_ptr<clang::ASTUnit> result;
+    ASTBuilderAction action(result, declarations_only);
+    clang::tooling::ToolInvocation invocation(std::move(command_line), &action, files.get());
+    if (!invocation.run())
+    {
+        return nullptr;
+    }
+    return result.release();
+}
+
+size_t astMemoryUsage(clang::ASTUnit* ast)
+{
+    const clang::ASTContext& context = ast->getASTContext();
+    return context.getASTAllocatedMemory() + context.getSideTableAllocatedMemory();
+}
+
+bool astHasErrors(clang::ASTUnit* ast)
+{
+    return ast->getDiagnostics().hasErrorOccurred();
+}
+
+bool saveAST(clang::ASTUnit* ast, char * filename)
+{
+    // ASTUnit::Save writes to a temporary and renames it into place,
+    // so a concurrent run never sees a half-written file.
+    // It returns true on failure.
+    return !ast->Save(filename);
+}
+
+clang::ASTUnit* loadAST(char * filename, size_t file_count, char** file_names, char** file_contents)
+{
+    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diagnostics =
+        clang::CompilerInstance::createDiagnostics(new clang::DiagnosticOptions());
+
+    // The AST file records the umbrella source as one of its inputs, and
+    // clang checks it along with the rest.  It only ever existed in memory,
+    // so it has to be handed over again.  Remapped files get a modification
+    // time of 0, which is what buildAST gave it.  The ASTUnit owns the
+    // buffers from here on.
+    std::vector<clang::ASTUnit::RemappedFile> remapped_files;
+    remapped_files.reserve(file_count);
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        remapped_files.emplace_back(file_names[i],
+            llvm::MemoryBuffer::getMemBufferCopy(file_contents[i], file_names[i]).release());
+    }
+    return clang::ASTUnit::LoadFromASTFile(filename,
+                                           pchOperations()->getRawReader(),
+                                           diagnostics,
+                                           clang::FileSystemOptions(),
+                                           /*UseDebugInfo=*/false,
+                                           /*OnlyLocalDecls=*/false,
+                                           remapped_files).release();
+}
+
+bool reparseAST(clang::ASTUnit* ast, char * contents)
+{
+    // Reparsing builds a new file manager on the real file system,
+    // so the umbrella source has to be handed over as a remapped file.
+    // The ASTUnit owns the buffer from here on.
+    std::unique_ptr<llvm::MemoryBuffer> buffer =
+        llvm::MemoryBuffer::getMemBufferCopy(contents, ast->getMainFileName());
+    clang::ASTUnit::RemappedFile umbrella(ast->getMainFileName(), buffer.release());
+    // Reparse returns true on failure
+    if (ast->Reparse(pchOperations(), umbrella))
+    {
+        return false;
+    }
+    return !astHasErrors(ast);
+}
+
+size_t astFileCount(clang::ASTUnit* ast)
+{
+    return filesInAST(ast).size();
+}
+
+void astFileNames(clang::ASTUnit* ast, const char ** names)
+{
+    for (const clang::FileEntry* file : filesInAST(ast))
+    {
+        *names = file->getName();
+        ++names;
     }
-    return clang::tooling::buildASTFromCodeWithArgs(contents, clang_args, filename).release();
+}
+
+void astFileStates(clang::ASTUnit* ast, std::time_t* times, size_t* sizes,
+                   const char ** contents, size_t* lengths)
+{
+    std::map<const clang::FileEntry*, const llvm::MemoryBuffer*> buffers;
+    const clang::SourceManager& sources = ast->getSourceManager();
+    for (auto entry = sources.fileinfo_begin(); entry != sources.fileinfo_end(); ++entry)
+    {
+        buffers[entry->first] = entry->second->getRawBuffer();
+    }
+
+    for (const clang::FileEntry* file : filesInAST(ast))
+    {
+        *times = file->getModificationTime();
+        *sizes = file->getSize();
+        auto buffer = buffers.find(file);
+        if (buffer != buffers.end() && buffer->second)
+        {
+            *contents = buffer->second->getBufferStart();
+            *lengths = buffer->second->getBufferSize();
+        }
+        else
+        {
+            *contents = nullptr;
+            *lengths = 0;
+        }
+        ++times;
+        ++sizes;
+        ++contents;
+        ++lengths;
+    }
+}
+
+bool astIsOutOfDate(clang::ASTUnit* ast)
+{
+    // Files that were preloaded into memory are compared with the copies
+    // on disk.  Files that only exist in memory, like the umbrella source,
+    // are checked against themselves.
+    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> real_fs = clang::vfs::getRealFileSystem();
+    clang::FileManager& files = ast->getFileManager();
+    for (const clang::FileEntry* file : filesInAST(ast))
+    {
+        llvm::ErrorOr<clang::vfs::Status> status = real_fs->status(file->getName());
+        if (!status)
+        {
+            status = files.getVirtualFileSystem()->status(file->getName());
+        }
+        if (!status)
+        {
+            return true;
+        }
+        if (status->getLastModificationTime().toEpochTime() != file->getModificationTime()
+            || status->getSize() != static_cast<uint64_t>(file->getSize()))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void freeAST(clang::ASTUnit* ast)
+{
+    delete ast;
 }
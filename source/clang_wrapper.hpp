@@ -19,11 +19,67 @@
 #ifndef __CLANG_WRAPPER_HPP__
 #define __CLANG_WRAPPER_HPP__
 
+#include <cstddef>
+#include <ctime>
+
 namespace clang
 {
     class ASTUnit;
 }
 
-clang::ASTUnit* buildAST(char * contents, size_t arg_len, char** raw_args, char * filename);
+// Parses contents as if it were a source file named filename.
+// filename only exists in memory, so it never shadows a file on disk.
+// Clang reads the file_count files named in file_names from file_contents
+// instead of from disk; file_times are their modification times.
+// When declarations_only is set, clang skips function bodies and
+// everything that only they need, and does not emit warnings.
+clang::ASTUnit* buildAST(char * contents, size_t arg_len, char** raw_args, char * filename,
+                         size_t file_count, char** file_names, char** file_contents, std::time_t* file_times,
+                         bool declarations_only);
+
+// Bytes used by the AST's nodes and side tables
+size_t astMemoryUsage(clang::ASTUnit* ast);
+
+// Did clang report any errors while building ast?
+bool astHasErrors(clang::ASTUnit* ast);
+
+// Serializes ast to filename in clang's AST file format.
+// The result can be passed back to clang with -include-pch.
+// Returns true if the file was written.
+bool saveAST(clang::ASTUnit* ast, char * filename);
+
+// Loads an AST written by saveAST without running the parser.
+// The files that buildAST only had in memory, like the umbrella source,
+// are given as file_names and file_contents.
+// Returns nullptr if the file cannot be read or any file it was built from
+// has changed since.
+clang::ASTUnit* loadAST(char * filename, size_t file_count, char** file_names, char** file_contents);
+
+// Parses ast's main file again, with contents as its new source.
+// Any headers that changed are read again.  Only works for ASTs from
+// buildAST.  Returns true if the new AST has no errors.
+bool reparseAST(clang::ASTUnit* ast, char * contents);
+
+// Number of files clang read to build ast, including the ones that went
+// into a precompiled header or AST file it loaded
+size_t astFileCount(clang::ASTUnit* ast);
+
+// Fills names with the astFileCount(ast) files clang read to build ast.
+// The names live as long as ast does.
+void astFileNames(clang::ASTUnit* ast, const char ** names);
+
+// Fills times and sizes with the modification times and sizes clang saw
+// for the astFileCount(ast) files, in the same order as astFileNames.
+// contents and lengths get the text clang parsed, or nullptr for files
+// that clang only checked, like the inputs of a precompiled header.
+// The contents live as long as ast does.
+void astFileStates(clang::ASTUnit* ast, std::time_t* times, size_t* sizes,
+                   const char ** contents, size_t* lengths);
+
+// Has any file that went into ast changed since it was parsed?
+bool astIsOutOfDate(clang::ASTUnit* ast);
+
+// Releases an AST returned by buildAST or loadAST
+void freeAST(clang::ASTUnit* ast);
 
 #endif // __CLANG_WRAPPER_HPP__
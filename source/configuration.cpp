@@ -20,95 +20,199 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <regex>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "clang/AST/DeclCXX.h"
 #include "clang/Frontend/ASTUnit.h"
 
 #include "configuration.hpp"
 #include "cpp_decl.hpp"
 
-static clang::DeclContextLookupResult lookupDeclName(const binder::string& binder_name, clang::ASTContext& ast, clang::DeclContext* context)
+// Every declaration that a qualified name in the configuration can refer
+// to, by that name.  It sees what DeclContext::lookup would: the contents
+// of linkage specs, unscoped enums and inline namespaces are also found in
+// the scope around them.  Built once for all of the ASTs, so that each of
+// the thousands of names in a configuration is a single hash lookup.
+class QualifiedNameIndex
 {
-    std::string name(binder_name.c_str());
-    std::string top_name;
-    auto scope_start = std::adjacent_find(begin(name), end(name), [](char a, char b) {
-                if( a != ':' ) return false;
-                return a == b;
-                });
-    top_name = std::string(begin(name), scope_start);
+    public:
+    typedef std::unordered_map<std::string, std::vector<clang::NamedDecl*>> map_t;
 
-    clang::IdentifierInfo& id_info = ast.Idents.get(top_name);
-    clang::DeclarationName decl_name = ast.DeclarationNames.getIdentifier(&id_info);
+    private:
+    std::vector<clang::ASTUnit*> units;
+    map_t decls_by_name;
 
-    clang::DeclContextLookupResult result = context->lookup(decl_name);
-    if( scope_start == end(name) )
+    // A scope to index, and the prefixes that its names are found under
+    struct Scope
     {
-        return result;
+        clang::DeclContext* context;
+        std::vector<std::string> prefixes;
+    };
+
+    void indexUnit(clang::ASTUnit* unit)
+    {
+        std::vector<Scope> scopes;
+        scopes.push_back({unit->getASTContext().getTranslationUnitDecl(), {""}});
+        while (!scopes.empty())
+        {
+            Scope scope = std::move(scopes.back());
+            scopes.pop_back();
+
+            for (clang::Decl* decl : scope.context->decls())
+            {
+                if (llvm::isa<clang::LinkageSpecDecl>(decl))
+                {
+                    scopes.push_back({clang::Decl::castToDeclContext(decl), scope.prefixes});
+                    continue;
+                }
+
+                clang::NamedDecl* named = llvm::dyn_cast<clang::NamedDecl>(decl);
+                if (!named || !named->getDeclName().isIdentifier())
+                {
+                    continue;
+                }
+                std::string name = named->getName();
+
+                clang::NamespaceDecl* ns = llvm::dyn_cast<clang::NamespaceDecl>(named);
+                // Every time a namespace is reopened it is the same one
+                if (!ns || ns->isOriginalNamespace())
+                {
+                    for (const std::string& prefix : scope.prefixes)
+                    {
+                        decls_by_name[prefix + name].push_back(named);
+                    }
+                }
+
+                Scope inner{nullptr, {}};
+                for (const std::string& prefix : scope.prefixes)
+                {
+                    inner.prefixes.push_back(prefix + name + "::");
+                }
+                if (ns)
+                {
+                    inner.context = ns;
+                    if (ns->isInline())
+                    {
+                        inner.prefixes.insert(inner.prefixes.end(), scope.prefixes.begin(), scope.prefixes.end());
+                    }
+                }
+                else if (clang::EnumDecl* enum_decl = llvm::dyn_cast<clang::EnumDecl>(named))
+                {
+                    inner.context = enum_decl;
+                    if (!enum_decl->isScoped())
+                    {
+                        inner.prefixes.insert(inner.prefixes.end(), scope.prefixes.begin(), scope.prefixes.end());
+                    }
+                }
+                else if (clang::RecordDecl* record = llvm::dyn_cast<clang::RecordDecl>(named))
+                {
+                    // Lookups in a record go to its definition
+                    if (record->isThisDeclarationADefinition() && !record->isInjectedClassName())
+                    {
+                        inner.context = record;
+                    }
+                }
+                if (inner.context)
+                {
+                    scopes.push_back(std::move(inner));
+                }
+            }
+        }
     }
-    else
+
+    public:
+    // The index is kept until it is asked about different ASTs
+    void build(size_t unit_count, clang::ASTUnit** astunits)
     {
-        std::string remaining_name = std::string(scope_start + 2, end(name));
-        if( result.size() == 0 )
+        std::vector<clang::ASTUnit*> requested(astunits, astunits + unit_count);
+        if (requested == units)
         {
-            throw std::runtime_error(std::string("Looking for a decl (")+ name + ") contained by another decl, but the outer decl does not contain the inner decl.");
+            return;
         }
-        else if( result.size() > 1 )
+
+        units = std::move(requested);
+        decls_by_name.clear();
+        for (clang::ASTUnit* unit : units)
         {
-            throw std::runtime_error("Looking for a nested decl, but found many decls at one step on the path.");
+            indexUnit(unit);
         }
-        else {
-            clang::NamedDecl * decl = result.front();
-            clang::DeclContext * next_context = clang::Decl::castToDeclContext(decl);
-            return lookupDeclName(binder::string(remaining_name.c_str()), ast, next_context);
+    }
+
+    const std::vector<clang::NamedDecl*>* find(const std::string& name) const
+    {
+        auto search_result = decls_by_name.find(name);
+        if (search_result == decls_by_name.end())
+        {
+            return nullptr;
         }
+        return &search_result->second;
     }
-}
-static clang::DeclContextLookupResult lookupDeclName(const binder::string* binder_name, clang::ASTContext& ast, clang::DeclContext* context)
-{
-    return lookupDeclName(*binder_name, ast, context);
-}
 
-void applyConfigToObject(const binder::string* name, clang::ASTUnit* astunit, const DeclarationAttributes* decl_attributes, const TypeAttributes* type_attributes)
+    const map_t& names() const
+    {
+        return decls_by_name;
+    }
+};
+
+static QualifiedNameIndex name_index;
+
+// Applies the attributes to each of the decls that has not had them applied
+// already.  When the headers were parsed in shards, the same entity can be
+// found in several ASTs, but they all share one Declaration.
+static void applyConfigToDecls(const std::vector<clang::NamedDecl*>& cppDecls, const char* name, std::unordered_set<Declaration*>& applied, const DeclarationAttributes* decl_attributes, const TypeAttributes* type_attributes)
 {
-    clang::ASTContext& ast = astunit->getASTContext();
-    // Find the thing to add decl_attributes
-    clang::DeclContextLookupResult lookup_result = lookupDeclName(name, ast, ast.getTranslationUnitDecl());
-    if( lookup_result.size() > 0 )
-    {
-        // TODO finding more than one match should probably
-        // be handled more gracefully.
-        for (clang::NamedDecl* cppDecl : lookup_result)
-        {
-            Declaration* decl;
-            try {
-                decl = getDeclaration(cppDecl);
-            }
-            catch (std::out_of_range& exc)
-            {
-                std::cerr << "Could not find declaration for " << name << "\n";
-                continue;
-            }
-            if (decl == nullptr)
-            {
-                std::cerr << "Could not find declaration for " << name << "\n";
-                continue;
-            }
+    // TODO finding more than one match should probably
+    // be handled more gracefully.
+    for (clang::NamedDecl* cppDecl : cppDecls)
+    {
+        Declaration* decl;
+        try {
+            decl = getDeclaration(cppDecl);
+        }
+        catch (std::out_of_range& exc)
+        {
+            std::cerr << "Could not find declaration for " << name << "\n";
+            continue;
+        }
+        if (decl == nullptr)
+        {
+            std::cerr << "Could not find declaration for " << name << "\n";
+            continue;
+        }
+        if (!applied.insert(decl).second)
+        {
+            continue;
+        }
 
-            decl->applyAttributes(decl_attributes);
-            try {
-                if (decl->isWrappable() && decl->getType() != nullptr)
-                {
-                    decl->getType()->applyAttributes(type_attributes);
-                }
-            }
-            catch (NotTypeDecl&)
-            {
-                // If the decl is not a type decl, then we don't apply type
-                // attributes to it, so nothing to do here.
-            }
+        decl->applyAttributes(decl_attributes);
+        // If the decl is not a type decl, then we don't apply type
+        // attributes to it.
+        Type* type = decl->isWrappable() ? decl->getType() : nullptr;
+        if (type != nullptr)
+        {
+            type->applyAttributes(type_attributes);
         }
     }
-    else {
+}
+
+void applyConfigToObject(const binder::string* name, size_t unit_count, clang::ASTUnit** astunits, const DeclarationAttributes* decl_attributes, const TypeAttributes* type_attributes)
+{
+    std::unordered_set<Declaration*> applied;
+    name_index.build(unit_count, astunits);
+    const std::vector<clang::NamedDecl*>* lookup_result = name_index.find(name->c_str());
+    bool found = (lookup_result != nullptr);
+    if (found)
+    {
+        applyConfigToDecls(*lookup_result, name->c_str(), applied, decl_attributes, type_attributes);
+    }
+
+    if (!found)
+    {
         Type::range_t search_result = Type::getByName(name);
 
         if (search_result.first == search_result.second)
@@ -130,5 +234,156 @@ void applyConfigToObject(const binder::string* name, clang::ASTUnit* astunit, co
             type->applyAttributes(type_attributes);
         }
     }
+}
+
+// A key of binding_attributes that selects every name matching it
+class NameSelector
+{
+    std::string key;
+    std::regex pattern;
+    // Every name the pattern matches starts with this,
+    // so most names are rejected without running the regex.
+    std::string literal_prefix;
+
+    static bool isRegexSpecial(char c)
+    {
+        return std::strchr(".[]{}()\\*+?|^$", c) != nullptr;
+    }
+
+    // * and ? stay inside one component of the name, ** does not
+    static std::string globToRegex(const std::string& glob)
+    {
+        std::string result;
+        for (size_t idx = 0; idx < glob.size(); ++idx)
+        {
+            if (glob[idx] == '*' && idx + 1 < glob.size() && glob[idx + 1] == '*')
+            {
+                result += ".*";
+                ++idx;
+            }
+            else if (glob[idx] == '*')
+            {
+                result += "[^:]*";
+            }
+            else if (glob[idx] == '?')
+            {
+                result += "[^:]";
+            }
+            else
+            {
+                if (isRegexSpecial(glob[idx]))
+                {
+                    result += '\\';
+                }
+                result += glob[idx];
+            }
+        }
+        return result;
+    }
 
+    // The characters every match has to start with
+    static std::string literalPrefix(const std::string& regex)
+    {
+        if (regex.find('|') != std::string::npos)
+        {
+            return "";
+        }
+        size_t length = 0;
+        while (length < regex.size() && !isRegexSpecial(regex[length]))
+        {
+            ++length;
+        }
+        // A quantifier makes the character before it optional
+        if (length > 0 && length < regex.size() && std::strchr("*?{", regex[length]) != nullptr)
+        {
+            --length;
+        }
+        return regex.substr(0, length);
+    }
+
+    public:
+    const DeclarationAttributes* decl_attributes;
+    const TypeAttributes* type_attributes;
+    std::unordered_set<Declaration*> applied;
+
+    NameSelector(const std::string& k, const DeclarationAttributes* decl_attrs, const TypeAttributes* type_attrs)
+        : key(k), decl_attributes(decl_attrs), type_attributes(type_attrs)
+    {
+        std::string regex;
+        if (key.size() >= 2 && key.front() == '/' && key.back() == '/')
+        {
+            regex = key.substr(1, key.size() - 2);
+        }
+        else
+        {
+            regex = globToRegex(key);
+        }
+        pattern = std::regex(regex, std::regex::ECMAScript | std::regex::optimize);
+        literal_prefix = literalPrefix(regex);
+    }
+
+    const std::string& getKey() const
+    {
+        return key;
+    }
+
+    // The order selectors are applied in, so that the ones applied later
+    // override the ones applied earlier: the longer literal prefix wins,
+    // and between prefixes of the same length, the greater key
+    bool operator<(const NameSelector& other) const
+    {
+        if (literal_prefix.size() != other.literal_prefix.size())
+        {
+            return literal_prefix.size() < other.literal_prefix.size();
+        }
+        return key < other.key;
+    }
+
+    bool matches(const std::string& name) const
+    {
+        return name.compare(0, literal_prefix.size(), literal_prefix) == 0
+            && std::regex_match(name, pattern);
+    }
+};
+
+void applyConfigToPatterns(size_t pattern_count, const binder::string* const* patterns, const DeclarationAttributes* const* decl_attributes, const TypeAttributes* const* type_attributes, size_t unit_count, clang::ASTUnit** astunits)
+{
+    std::vector<NameSelector> selectors;
+    selectors.reserve(pattern_count);
+    for (size_t idx = 0; idx < pattern_count; ++idx)
+    {
+        try {
+            selectors.emplace_back(patterns[idx]->c_str(), decl_attributes[idx], type_attributes[idx]);
+        }
+        catch (std::regex_error& exc)
+        {
+            std::cerr << "WARNING: " << patterns[idx]->c_str() << " is not a valid regular expression.\n";
+        }
+    }
+    if (selectors.empty())
+    {
+        return;
+    }
+    // The keys come out of the JSON object in no particular order
+    std::sort(selectors.begin(), selectors.end());
+
+    name_index.build(unit_count, astunits);
+    for (const auto& entry : name_index.names())
+    {
+        for (NameSelector& selector : selectors)
+        {
+            if (selector.matches(entry.first))
+            {
+                applyConfigToDecls(entry.second, entry.first.c_str(), selector.applied, selector.decl_attributes, selector.type_attributes);
+            }
+        }
+    }
+
+    for (const NameSelector& selector : selectors)
+    {
+        if (selector.applied.empty())
+        {
+            std::cerr << "WARNING: " << selector.getKey() << " does not match anything in the C++ source.\n";
+        }
+    }
 }
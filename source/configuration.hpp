@@ -19,6 +19,8 @@
 #ifndef __CONFIGURATION_HPP__
 #define __CONFIGURATION_HPP__
 
+#include <cstddef>
+
 namespace clang
 {
     class ASTUnit;
@@ -32,6 +34,13 @@ namespace binder
 class DeclarationAttributes;
 class TypeAttributes;
 
-void applyConfigToObject(const binder::string* name, clang::ASTUnit* astunit, const DeclarationAttributes* decl_attributes, const TypeAttributes* type_attributes);
+// Looks name up in each of the ASTs and applies the attributes to what it finds
+void applyConfigToObject(const binder::string* name, size_t unit_count, clang::ASTUnit** astunits, const DeclarationAttributes* decl_attributes, const TypeAttributes* type_attributes);
+
+// Applies each pattern's attributes to every declaration whose qualified
+// name matches it.  A pattern between slashes is a regular expression;
+// anything else is a glob.  All of the patterns are matched in one pass
+// over the names in the ASTs.
+void applyConfigToPatterns(size_t pattern_count, const binder::string* const* patterns, const DeclarationAttributes* const* decl_attributes, const TypeAttributes* const* type_attributes, size_t unit_count, clang::ASTUnit** astunits);
 
 #endif // __CONFIGURATION_HPP__
@@ -16,20 +16,27 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <random>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 
-#include <boost/filesystem.hpp>
-
 #include "clang/AST/Decl.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Frontend/ASTUnit.h"
+#include "clang/Index/USRGeneration.h"
+#include "llvm/ADT/SmallString.h"
 
 #include "cpp_type.hpp"
 #include "cpp_decl.hpp"
 #include "cpp_expr.hpp"
+#include "statistics.hpp"
 
 DeclarationAttributes* DeclarationAttributes::make()
 {
@@ -45,7 +52,7 @@ void DeclarationAttributes::setBound(bool value)
 void DeclarationAttributes::setTargetModule(binder::string* value)
 {
     isTargetModuleSet = true;
-    target_module = *value;
+    target_module = intern(*value);
 }
 
 void DeclarationAttributes::setVisibility(Visibility value)
@@ -55,7 +62,12 @@ void DeclarationAttributes::setVisibility(Visibility value)
 
 void DeclarationAttributes::setRemovePrefix(binder::string* value)
 {
-    remove_prefix = *value;
+    remove_prefix = intern(*value);
+}
+
+bool Declaration::isReachable() const
+{
+    return reachable;
 }
 
 void Declaration::applyAttributes(const DeclarationAttributes* attribs)
@@ -195,25 +207,181 @@ bool isTemplateNonTypeParmDecl(const clang::Decl* decl)
     return TemplateTypeParmKinds.count(decl->getKind()) > 0;
 }
 
-std::unordered_map<const clang::Decl*, Declaration*> DeclVisitor::declarations;
+DeclVisitor::DeclarationMap DeclVisitor::declarations;
 std::unordered_set<Declaration*> DeclVisitor::free_declarations;
+bool DeclVisitor::merging_asts = false;
+std::deque<DeclVisitor::PendingDeclaration> DeclVisitor::pending_declarations;
+bool DeclVisitor::traversing_pending = false;
+std::unordered_map<std::string, Declaration*> DeclVisitor::declarations_by_usr;
+llvm::BumpPtrAllocator DeclVisitor::declaration_arena;
+std::vector<Declaration*> DeclVisitor::arena_declarations;
+// In the order they were traversed
+static std::vector<const clang::SourceManager*> traversed_sources;
+
+// The input files as each AST's file manager knows them.
+// The file manager gives a file the same entry however it is named,
+// so checking a declaration's file is a lookup instead of comparing
+// paths on disk.
+class InputFiles
+{
+    std::vector<std::string> filenames;
+    std::unordered_map<const clang::SourceManager*, std::unordered_set<const clang::FileEntry*>> entries;
+
+    public:
+    InputFiles()
+        : filenames(), entries()
+    { }
+
+    template<typename ConstIterator>
+    InputFiles(ConstIterator firstFile, ConstIterator lastFile)
+        : filenames(firstFile, lastFile), entries()
+    { }
+
+    bool empty() const
+    {
+        return filenames.empty();
+    }
+
+    const std::unordered_set<const clang::FileEntry*>& entriesFor(const clang::SourceManager& sources)
+    {
+        auto found = entries.find(&sources);
+        if (found != entries.end())
+        {
+            return found->second;
+        }
+
+        std::unordered_set<const clang::FileEntry*>& files = entries[&sources];
+        for (const std::string& name : filenames)
+        {
+            const clang::FileEntry* file = sources.getFileManager().getFile(name);
+            statistics::emit_filter_file_lookups++;
+            if (file)
+            {
+                files.insert(file);
+            }
+        }
+        return files;
+    }
+};
+
+// The file a declaration was written in, looking through macro expansions
+static const clang::FileEntry* declarationFile(const clang::Decl* decl)
+{
+    const clang::SourceManager& sources = decl->getASTContext().getSourceManager();
+    clang::SourceLocation source_loc = sources.getExpansionLoc(decl->getLocation());
+    return sources.getFileEntryForID(sources.getFileID(source_loc));
+}
+
+// When set, declarations directly inside namespaces that are not in one of
+// these files are only wrapped once something asks for them.
+static InputFiles lazy_input_files;
+
+// Declarations are wrapped along with the outermost record, function,
+// or template around them
+static const clang::Decl* outermostWrappedDecl(const clang::Decl* decl)
+{
+    const clang::Decl* outer = decl;
+    for (const clang::DeclContext* context = decl->getDeclContext();
+         context && !context->isFileContext() && context->getDeclKind() != clang::Decl::LinkageSpec;
+         context = context->getParent())
+    {
+        outer = clang::Decl::castFromDeclContext(context);
+    }
+    return outer;
+}
+
+// Whether the traversal leaves decl, a member of a namespace, to be wrapped later
+static bool isDeferred(const clang::Decl* decl)
+{
+    if (lazy_input_files.empty())
+    {
+        return false;
+    }
+    // Their contents still have to be looked at
+    if (llvm::isa<clang::NamespaceDecl>(decl) || llvm::isa<clang::LinkageSpecDecl>(decl))
+    {
+        return false;
+    }
+    const clang::FileEntry* file = declarationFile(decl);
+    if (!file)
+    {
+        // Builtins and the like
+        return false;
+    }
+    return !lazy_input_files.entriesFor(decl->getASTContext().getSourceManager()).count(file);
+}
+
+bool getMergeKey(const clang::Decl* decl, std::string& key)
+{
+    llvm::SmallString<128> usr;
+    // generateUSRForDecl returns true when the decl should be ignored
+    if (clang::index::generateUSRForDecl(decl, usr))
+    {
+        return false;
+    }
+    key = usr.str();
+    return true;
+}
+
+Declaration* DeclVisitor::findMergedDeclaration(const clang::Decl* decl)
+{
+    std::string usr;
+    if (!getMergeKey(decl, usr))
+    {
+        return nullptr;
+    }
+
+    auto search_result = declarations_by_usr.find(usr);
+    if (search_result == declarations_by_usr.end())
+    {
+        return nullptr;
+    }
+    return search_result->second;
+}
+
+void DeclVisitor::recordMergedDeclaration(const clang::Decl* decl, Declaration* result)
+{
+    std::string usr;
+    if (getMergeKey(decl, usr))
+    {
+        declarations_by_usr.insert(std::make_pair(usr, result));
+    }
+}
+
+void DeclVisitor::startMerging()
+{
+    if (merging_asts)
+    {
+        return;
+    }
+
+    // Everything from the first AST was registered before we knew
+    // there would be more than one, so catch up here.
+    merging_asts = true;
+    for (auto decl_pair : declarations)
+    {
+        recordMergedDeclaration(decl_pair.first, decl_pair.second);
+    }
+    Type::startMerging();
+}
 
 void printPresumedLocation(const clang::NamedDecl* Declaration, std::ostream& out = std::cout)
 {
     clang::SourceLocation source_loc = Declaration->getLocation();
-    clang::PresumedLoc presumed = source_manager->getPresumedLoc(source_loc);
+    clang::PresumedLoc presumed = Declaration->getASTContext().getSourceManager().getPresumedLoc(source_loc);
 
     out << Declaration->getNameAsString() << " at " << presumed.getFilename() << ":" << presumed.getLine() << "\n";
 }
 
 const RecordDeclaration* RecordDeclaration::getDefinition() const
 {
-    auto search_result = DeclVisitor::getDeclarations().find(_decl->getDefinition());
-    if( search_result == DeclVisitor::getDeclarations().end() )
+    const clang::RecordDecl* definition = _decl->getDefinition();
+    if( !definition )
     {
         return nullptr;
     }
-    Declaration* decl = search_result->second;
+    // The definition may be in a header that wasn't wrapped yet
+    Declaration* decl = ::getDeclaration(definition);
     return dynamic_cast<const RecordDeclaration*>(decl);
 }
 
@@ -500,12 +668,12 @@ MethodDeclaration* MethodRange::front()
 MethodDeclaration* OverriddenMethodIterator::operator*()
 {
     clang::Decl* mptr = const_cast<clang::CXXMethodDecl*>((*cpp_iter));
-    auto search_result = DeclVisitor::getDeclarations().find(mptr);
-    if( search_result == DeclVisitor::getDeclarations().end() )
+    // The base class may be in a header that wasn't wrapped yet
+    Declaration* decl = ::getDeclaration(mptr);
+    if( !decl )
     {
         throw std::runtime_error("Lookup failed!");
     }
-    Declaration* decl = search_result->second;
     MethodDeclaration * result = dynamic_cast<MethodDeclaration*>(decl);
     return result;
 }
@@ -620,12 +788,11 @@ SpecializedRecordDeclaration* SpecializedRecordRange::front()
 
 RecordTemplateDeclaration* SpecializedRecordDeclaration::getGenericDeclaration() const
 {
-    auto search_result = DeclVisitor::getDeclarations().find(template_decl->getSpecializedTemplate());
-    if( search_result == DeclVisitor::getDeclarations().end() )
+    Declaration* decl = ::getDeclaration(template_decl->getSpecializedTemplate());
+    if( !decl )
     {
         throw std::runtime_error("Lookup failed!");
     }
-    Declaration* decl = search_result->second;
     auto result = dynamic_cast<RecordTemplateDeclaration*>(decl);
     return result;
 }
@@ -650,9 +817,180 @@ Expression* TemplateNonTypeArgumentDeclaration::getDefaultArgument() const
     return wrapClangExpression(_decl->getDefaultArgument());
 }
 
+// Walks several ranges one after another
+class ConcatenatedDeclarationRange : public DeclarationRange
+{
+    std::vector<DeclarationRange*> ranges;
+    size_t current;
+
+    void skipEmptyRanges()
+    {
+        while (current < ranges.size() && ranges[current]->empty())
+        {
+            ++current;
+        }
+    }
+
+    public:
+    explicit ConcatenatedDeclarationRange(std::vector<DeclarationRange*> r)
+        : DeclarationRange(iterator_t(), iterator_t()), ranges(std::move(r)), current(0)
+    {
+        skipEmptyRanges();
+    }
+
+    virtual bool empty() override
+    {
+        return current == ranges.size();
+    }
+
+    virtual Declaration* front() override
+    {
+        return ranges[current]->front();
+    }
+
+    virtual void popFront() override
+    {
+        ranges[current]->popFront();
+        skipEmptyRanges();
+    }
+};
+
 DeclarationRange* NamespaceDeclaration::getChildren()
 {
-    return new RedeclarableContextDeclarationRange<clang::NamespaceDecl>(_decl->redecls());
+    if (merged_decls.empty())
+    {
+        return new RedeclarableContextDeclarationRange<clang::NamespaceDecl>(_decl->redecls());
+    }
+
+    std::vector<DeclarationRange*> ranges;
+    ranges.push_back(new RedeclarableContextDeclarationRange<clang::NamespaceDecl>(_decl->redecls()));
+    for (const clang::NamespaceDecl* other : merged_decls)
+    {
+        ranges.push_back(new RedeclarableContextDeclarationRange<clang::NamespaceDecl>(other->redecls()));
+    }
+    return new ConcatenatedDeclarationRange(std::move(ranges));
+}
+
+void ChildDeclarations::build(const std::vector<const clang::DeclContext*>& contexts)
+{
+    children.clear();
+    std::unordered_set<Declaration*> seen;
+    for (const clang::DeclContext* context : contexts)
+    {
+        for (const clang::Decl* decl : context->decls())
+        {
+            auto search_result = DeclVisitor::getDeclarations().find(decl);
+            if (search_result == DeclVisitor::getDeclarations().end())
+            {
+                continue;
+            }
+            // e.g. a forward declaration and the definition
+            if (seen.insert(search_result->second).second)
+            {
+                children.push_back(search_result->second);
+            }
+        }
+    }
+    built = true;
+}
+
+void NamespaceDeclaration::buildChildren()
+{
+    std::vector<const clang::DeclContext*> contexts;
+    for (const clang::NamespaceDecl* redecl : _decl->redecls())
+    {
+        contexts.push_back(redecl);
+    }
+    for (const clang::NamespaceDecl* other : merged_decls)
+    {
+        for (const clang::NamespaceDecl* redecl : other->redecls())
+        {
+            contexts.push_back(redecl);
+        }
+    }
+    children.build(contexts);
+}
+
+size_t NamespaceDeclaration::getChildCount()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.size();
+}
+
+Declaration** NamespaceDeclaration::getChildArray()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.data();
+}
+
+void RecordDeclaration::buildChildren()
+{
+    children.build(std::vector<const clang::DeclContext*>(1, definitionOrThis()));
+}
+
+size_t RecordDeclaration::getChildCount()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.size();
+}
+
+Declaration** RecordDeclaration::getChildArray()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.data();
+}
+
+void UnionDeclaration::buildChildren()
+{
+    children.build(std::vector<const clang::DeclContext*>(1, _decl));
+}
+
+size_t UnionDeclaration::getChildCount()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.size();
+}
+
+Declaration** UnionDeclaration::getChildArray()
+{
+    if (!children.isBuilt())
+    {
+        buildChildren();
+    }
+    return children.data();
+}
+
+void NamespaceDeclaration::addMergedDecl(const clang::NamespaceDecl* d)
+{
+    // Redeclarations from the same AST are already on _decl's redecl chain
+    const clang::NamespaceDecl* canonical = d->getCanonicalDecl();
+    if (canonical == _decl->getCanonicalDecl())
+    {
+        return;
+    }
+    for (const clang::NamespaceDecl* other : merged_decls)
+    {
+        if (other == canonical)
+        {
+            return;
+        }
+    }
+    merged_decls.push_back(canonical);
 }
 
 UsingAliasTemplateDeclaration::UsingAliasTemplateDeclaration(const clang::TypeAliasTemplateDecl* d)
@@ -702,27 +1040,68 @@ TemplateArgumentIterator * UsingAliasTemplateDeclaration::getTemplateArgumentEnd
 
 DeclVisitor::DeclVisitor(const clang::PrintingPolicy* pp)
     : Super(), top_level_decls(false), decl_in_progress(nullptr),
-      print_policy(pp), template_list(nullptr)
+      skipped_unwrappable(false), print_policy(pp), template_list(nullptr)
 { }
 
 // FIXME this method doesn't do registration anymore
-bool DeclVisitor::registerDeclaration(clang::Decl* cppDecl, bool top_level, clang::TemplateParameterList* tl)
+bool DeclVisitor::registerDeclaration(clang::Decl* cppDecl, bool top_level, clang::TemplateParameterList* tl, Declaration* owner)
 {
-    bool result = true;
-    DeclVisitor next_visitor(print_policy);
-    next_visitor.top_level_decls = top_level;
-    next_visitor.template_list = tl;
-    result = next_visitor.TraverseDecl(cppDecl);
-
-    auto search_result = declarations.find(cppDecl);
-    if( top_level && search_result != declarations.end() && !free_declarations.count(search_result->second) )
+    pending_declarations.push_back({cppDecl, top_level, tl, owner});
+    // Otherwise the loop further up the stack will get to it
+    if( !traversing_pending )
     {
-        // FIXME insert into free_declarations here and in allocateDeclaration
-        // should pick one and only do it there
-        free_declarations.insert(search_result->second);
+        traversePendingDeclarations();
     }
 
-    return result;
+    return true;
+}
+
+void DeclVisitor::traversePendingDeclarations()
+{
+    bool already_traversing = traversing_pending;
+    traversing_pending = true;
+    // Each declaration starts from a clean slate, as if it had a visitor to itself
+    DeclVisitor visitor(print_policy);
+    try {
+        while( !pending_declarations.empty() )
+        {
+            PendingDeclaration next = pending_declarations.front();
+            pending_declarations.pop_front();
+
+            visitor.top_level_decls = next.top_level;
+            visitor.decl_in_progress = nullptr;
+            visitor.skipped_unwrappable = false;
+            visitor.template_list = next.template_list;
+            visitor.TraverseDecl(next.decl);
+            if( visitor.skipped_unwrappable )
+            {
+                statistics::unwrappable_declarations++;
+                if( next.owner )
+                {
+                    next.owner->markUnwrappable();
+                }
+                else
+                {
+                    visitor.allocateDeclaration<clang::Decl, UnwrappableDeclaration>(next.decl);
+                }
+            }
+
+            auto search_result = declarations.find(next.decl);
+            if( next.top_level && search_result != declarations.end() && !free_declarations.count(search_result->second) )
+            {
+                // FIXME insert into free_declarations here and in allocateDeclaration
+                // should pick one and only do it there
+                free_declarations.insert(search_result->second);
+            }
+        }
+    }
+    catch( ... )
+    {
+        pending_declarations.clear();
+        traversing_pending = already_traversing;
+        throw;
+    }
+    traversing_pending = already_traversing;
 }
 
 #define TRAVERSE_PART(Title, TYPE, field) \
@@ -741,18 +1120,67 @@ bool DeclVisitor::Traverse##Title##Helper(TYPE* context, bool top_level) \
 
 bool DeclVisitor::TraverseDeclContext(clang::DeclContext* context, bool top_level)
 {
+    // Record members are always wrapped along with their record
+    bool namespace_scope = context->isFileContext() || context->getDeclKind() == clang::Decl::LinkageSpec;
+
     bool result = true;
     clang::DeclContext::decl_iterator end = context->decls_end();
     for( clang::DeclContext::decl_iterator iter = context->decls_begin();
          iter != end && result;
          ++iter )
     {
+        if( namespace_scope && isDeferred(*iter) )
+        {
+            statistics::deferred_declarations++;
+            continue;
+        }
         result = registerDeclaration(*iter, top_level);
     }
 
     return result;
 }
 
+Declaration* DeclVisitor::materialize(const clang::Decl* decl)
+{
+    const clang::Decl* outer = outermostWrappedDecl(decl);
+    if( !isDeferred(outer) )
+    {
+        // The traversal already had its chance
+        return nullptr;
+    }
+
+    bool top_level = outer->getDeclContext()->getRedeclContext()->isTranslationUnit();
+    DeclVisitor visitor(&outer->getASTContext().getPrintingPolicy());
+    visitor.registerDeclaration(const_cast<clang::Decl*>(outer), top_level);
+    // Someone might be asking in the middle of a traversal
+    visitor.traversePendingDeclarations();
+
+    // The enclosing namespace may have collected its children already
+    for (const clang::DeclContext* context = outer->getDeclContext(); context; context = context->getParent())
+    {
+        if (const clang::NamespaceDecl* ns = llvm::dyn_cast<clang::NamespaceDecl>(context))
+        {
+            auto ns_result = declarations.find(ns);
+            if (ns_result != declarations.end())
+            {
+                if (NamespaceDeclaration* ns_decl = dynamic_cast<NamespaceDeclaration*>(ns_result->second))
+                {
+                    ns_decl->invalidateChildren();
+                }
+            }
+            break;
+        }
+    }
+
+    auto search_result = declarations.find(decl);
+    if( search_result == declarations.end() )
+    {
+        return nullptr;
+    }
+    statistics::materialized_declarations++;
+    return search_result->second;
+}
+
 bool DeclVisitor::TraverseDecl(clang::Decl * Declaration)
 {
     if( !Declaration ) // FIXME sometimes Declaration is null.  I don't know why.
@@ -762,20 +1190,7 @@ bool DeclVisitor::TraverseDecl(clang::Decl * Declaration)
     {
         return true;
     }
-    try {
-        RecursiveASTVisitor<DeclVisitor>::TraverseDecl(Declaration);
-    }
-    catch( SkipUnwrappableType& e)
-    {
-        if( decl_in_progress )
-        {
-            decl_in_progress->markUnwrappable();
-        }
-        else
-        {
-            allocateDeclaration<clang::Decl, UnwrappableDeclaration>(Declaration);
-        }
-    }
+    RecursiveASTVisitor<DeclVisitor>::TraverseDecl(Declaration);
 
     return true;
 }
@@ -811,6 +1226,8 @@ bool DeclVisitor::TraverseCXXMethodDecl(clang::CXXMethodDecl* cppDecl)
     // FIXME hack to avoid translating out-of-line methods
     bool old_top_level = top_level_decls;
     top_level_decls = false; // method are never top level
+    if( cppDecl->hasSkippedBody() )
+        statistics::skipped_function_bodies++;
     //const clang::CXXRecordDecl * parent_decl = cppDecl->getParent();
     if( cppDecl->isDeleted() )
     {
@@ -819,26 +1236,20 @@ bool DeclVisitor::TraverseCXXMethodDecl(clang::CXXMethodDecl* cppDecl)
     }
 
     bool result = true;
-    try {
-        if( !WalkUpFromCXXMethodDecl(cppDecl) )
-        {
-            decl_in_progress->markUnwrappable();
-            return false;
-        }
-
-        // Notice that we don't traverse the body of the function
-        for( clang::ParmVarDecl** iter = cppDecl->param_begin();
-             result && iter != cppDecl->param_end();
-             iter++ )
-        {
-            result = registerDeclaration(*iter);
-        }
-    }
-    catch( SkipUnwrappableDeclaration& e )
+    if( !WalkUpFromCXXMethodDecl(cppDecl) )
     {
-        // If we can't wrap the return type or any of the arguments,
-        // then we cannot wrap the method declaration
         decl_in_progress->markUnwrappable();
+        return false;
+    }
+
+    // Notice that we don't traverse the body of the function
+    // If we can't wrap any of the arguments,
+    // then we cannot wrap the method declaration
+    for( clang::ParmVarDecl** iter = cppDecl->param_begin();
+         result && iter != cppDecl->param_end();
+         iter++ )
+    {
+        result = registerDeclaration(*iter, false, nullptr, decl_in_progress);
     }
     // FIXME hack to avoid translating out-of-line methods
     top_level_decls = old_top_level;
@@ -850,13 +1261,16 @@ bool DeclVisitor::WalkUpFromDecl(clang::Decl* cppDecl)
 {
     if( !decl_in_progress )
     {
-        throw SkipUnwrappableDeclaration(cppDecl);
+        skipped_unwrappable = true;
+        return false;
     }
     return Super::WalkUpFromDecl(cppDecl);
 }
 
 bool DeclVisitor::TraverseFunctionDecl(clang::FunctionDecl * cppDecl)
 {
+    if( cppDecl->hasSkippedBody() )
+        statistics::skipped_function_bodies++;
     if( !WalkUpFromFunctionDecl(cppDecl) ) return false;
     // Notice that we don't traverse the body of the function
     // Traverse the argument declarations
@@ -973,7 +1387,19 @@ bool DeclVisitor::WalkUpFrom##C##Decl(clang::C##Decl* cppDecl) \
     return Super::WalkUpFrom##C##Decl(cppDecl); \
 }
 WALK_UP(Typedef, Typedef)
-WALK_UP(Namespace, Namespace)
+
+bool DeclVisitor::WalkUpFromNamespaceDecl(clang::NamespaceDecl* cppDecl)
+{
+    if( !decl_in_progress )
+        allocateDeclaration<clang::NamespaceDecl, NamespaceDeclaration>(cppDecl);
+    if( merging_asts )
+    {
+        // The NamespaceDeclaration may have come from a different AST,
+        // and it needs to know about this AST's contents too
+        static_cast<NamespaceDeclaration*>(decl_in_progress)->addMergedDecl(cppDecl);
+    }
+    return Super::WalkUpFromNamespaceDecl(cppDecl);
+}
 WALK_UP(CXXMethod, Method)
 WALK_UP(ParmVar, Argument)
 WALK_UP(Enum, Enum)
@@ -997,7 +1423,8 @@ bool DeclVisitor::WalkUpFromRecordDecl(clang::RecordDecl* cppDecl)
     }
     else {
         // There's no logic to deal with these; we shouldn't reach here.
-        throw SkipUnwrappableDeclaration(cppDecl);
+        skipped_unwrappable = true;
+        return false;
     }
 
     return Super::WalkUpFromRecordDecl(cppDecl);
@@ -1010,9 +1437,7 @@ bool DeclVisitor::VisitClassTemplateDecl(clang::ClassTemplateDecl* cppDecl)
         if (!registerDeclaration(param, false, cppDecl->getTemplateParameters())) return false;
     }
 
-    DeclVisitor subVisitor(print_policy);
-    subVisitor.top_level_decls = false;
-    bool result = subVisitor.TraverseDecl(cppDecl->getTemplatedDecl());
+    bool result = registerDeclaration(cppDecl->getTemplatedDecl());
     if (!result)
     {
         return false;
@@ -1094,7 +1519,8 @@ bool DeclVisitor::WalkUpFromClassTemplateDecl(clang::ClassTemplateDecl* cppDecl)
         allocateDeclaration<clang::ClassTemplateDecl, RecordTemplateDeclaration>(cppDecl);
     }
     else {
-        throw SkipUnwrappableDeclaration(cppDecl);
+        skipped_unwrappable = true;
+        return false;
     }
 
     if (!Super::WalkUpFromClassTemplateDecl(cppDecl)) return false;
@@ -1250,8 +1676,17 @@ bool DeclVisitor::VisitTypedefDecl(clang::TypedefDecl* cppDecl)
 
 bool DeclVisitor::VisitNamedDecl(clang::NamedDecl* cppDecl)
 {
-    string source_name(cppDecl->getNameAsString().c_str());
-    decl_in_progress->setSourceName(&source_name);
+    // Most names are plain identifiers, which clang already has as text
+    if( cppDecl->getDeclName().isIdentifier() )
+    {
+        llvm::StringRef name = cppDecl->getName();
+        decl_in_progress->source_name = intern(name.data(), name.size());
+    }
+    else
+    {
+        std::string name = cppDecl->getNameAsString();
+        decl_in_progress->source_name = intern(name.c_str(), name.size());
+    }
     return true;
 }
 
@@ -1262,31 +1697,29 @@ bool DeclVisitor::VisitFieldDecl(clang::FieldDecl* cppDecl)
 
 class FilenameVisitor : public clang::RecursiveASTVisitor<FilenameVisitor>
 {
+    InputFiles input_files;
+
     public:
     Declaration* maybe_emits;
-    std::set<boost::filesystem::path> filenames;
 
     typedef clang::RecursiveASTVisitor<FilenameVisitor> Super;
 
     template<typename ConstIterator>
     FilenameVisitor(ConstIterator firstFile, ConstIterator lastFile)
-        : filenames(firstFile, lastFile)
+        : input_files(firstFile, lastFile)
     { }
 
     bool WalkUpFromNamedDecl(clang::NamedDecl* cppDecl)
     {
-        clang::SourceLocation source_loc = cppDecl->getLocation();
-        clang::PresumedLoc presumed = source_manager->getPresumedLoc(source_loc);
+        const clang::SourceManager& sources = cppDecl->getASTContext().getSourceManager();
+        const clang::FileEntry* file = declarationFile(cppDecl);
 
-        if (presumed.getFilename())
+        if (file)
         {
-            std::string this_filename = presumed.getFilename();
-            for (auto name : filenames)
+            statistics::emit_filter_checks++;
+            if (input_files.entriesFor(sources).count(file))
             {
-                if (boost::filesystem::equivalent(name, this_filename))
-                {
-                    maybe_emits->shouldEmit(true);
-                }
+                maybe_emits->shouldEmit(true);
             }
         }
 
@@ -1320,13 +1753,308 @@ class FilenameVisitor : public clang::RecursiveASTVisitor<FilenameVisitor>
     }
 };
 
+void DeclVisitor::reserveDeclarations(size_t expected)
+{
+    // DenseMap grows once it is three quarters full
+    unsigned buckets = llvm::NextPowerOf2((declarations.size() + expected) * 4 / 3);
+    if (declarations.getMemorySize() >= buckets * sizeof(DeclarationMap::value_type))
+    {
+        return;
+    }
+
+    DeclarationMap resized(buckets);
+    resized.insert(declarations.begin(), declarations.end());
+    declarations.swap(resized);
+}
+
+// Counts the declarations in a translation unit that the traversal will
+// register, without looking anything up, so that the registry can be sized
+// before the traversal fills it
+static size_t countDeclarations(clang::TranslationUnitDecl* tu)
+{
+    size_t count = 0;
+    std::vector<clang::DeclContext*> contexts(1, tu);
+    while (!contexts.empty())
+    {
+        clang::DeclContext* context = contexts.back();
+        contexts.pop_back();
+        // Same test as TraverseDeclContext
+        bool namespace_scope = context->isFileContext() || context->getDeclKind() == clang::Decl::LinkageSpec;
+        for (clang::Decl* decl : context->decls())
+        {
+            if (namespace_scope && isDeferred(decl))
+            {
+                continue;
+            }
+            ++count;
+            if (clang::FunctionDecl* function = llvm::dyn_cast<clang::FunctionDecl>(decl))
+            {
+                // The traversal stops at the arguments
+                count += function->getNumParams();
+            }
+            else if (clang::DeclContext* inner = llvm::dyn_cast<clang::DeclContext>(decl))
+            {
+                contexts.push_back(inner);
+            }
+        }
+    }
+    return count;
+}
+
 void traverseDeclsInAST(clang::ASTUnit* ast)
 {
+    if (!traversed_sources.empty())
+    {
+        DeclVisitor::startMerging();
+    }
+    traversed_sources.push_back(&ast->getSourceManager());
+
     source_manager = &(ast->getSourceManager());
 
+    clang::TranslationUnitDecl* tu = ast->getASTContext().getTranslationUnitDecl();
+    DeclVisitor::reserveDeclarations(countDeclarations(tu));
+
     DeclVisitor declVisitor(&ast->getASTContext().getPrintingPolicy());
 
-    declVisitor.TraverseDecl(ast->getASTContext().getTranslationUnitDecl());
+    declVisitor.TraverseDecl(tu);
+    statistics::declarations = DeclVisitor::declarations.size();
+
+    // Every declaration is registered now, so the children are final
+    // (until the next AST is merged in)
+    for (Declaration* decl : DeclVisitor::arena_declarations)
+    {
+        if (NamespaceDeclaration* ns = dynamic_cast<NamespaceDeclaration*>(decl))
+        {
+            ns->buildChildren();
+        }
+        else if (RecordDeclaration* record = dynamic_cast<RecordDeclaration*>(decl))
+        {
+            record->buildChildren();
+        }
+        else if (UnionDeclaration* union_decl = dynamic_cast<UnionDeclaration*>(decl))
+        {
+            union_decl->buildChildren();
+        }
+    }
+    statistics::declaration_bytes = DeclVisitor::declaration_arena.getBytesAllocated();
+}
+
+double declarationLookupsPerSecond()
+{
+    std::vector<const clang::Decl*> keys;
+    keys.reserve(DeclVisitor::declarations.size());
+    for (auto decl_pair : DeclVisitor::declarations)
+    {
+        keys.push_back(decl_pair.first);
+    }
+    if (keys.empty())
+    {
+        return 0;
+    }
+    // The traversal doesn't look declarations up in the order they are stored
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+
+    const size_t minimum_lookups = 1 << 22;
+    size_t lookups = 0;
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (lookups < minimum_lookups)
+    {
+        for (const clang::Decl* key : keys)
+        {
+            found += DeclVisitor::declarations.count(key);
+        }
+        lookups += keys.size();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (found != lookups || elapsed.count() <= 0)
+    {
+        return 0;
+    }
+    return lookups / elapsed.count();
+}
+
+// Collects the declarations that a type refers to, including the ones
+// behind pointers, function types, and template arguments
+class ReferencedDeclCollector : public clang::RecursiveASTVisitor<ReferencedDeclCollector>
+{
+    std::vector<const clang::Decl*>& found;
+
+    public:
+    explicit ReferencedDeclCollector(std::vector<const clang::Decl*>& f)
+        : found(f)
+    { }
+
+    bool VisitTagType(clang::TagType* type)
+    {
+        found.push_back(type->getDecl());
+        return true;
+    }
+
+    bool VisitTypedefType(clang::TypedefType* type)
+    {
+        found.push_back(type->getDecl());
+        return true;
+    }
+
+    bool VisitTemplateTypeParmType(clang::TemplateTypeParmType* type)
+    {
+        if (type->getDecl())
+        {
+            found.push_back(type->getDecl());
+        }
+        return true;
+    }
+
+    bool VisitTemplateSpecializationType(clang::TemplateSpecializationType* type)
+    {
+        if (clang::TemplateDecl* template_decl = type->getTemplateName().getAsTemplateDecl())
+        {
+            found.push_back(template_decl);
+        }
+        // The arguments are traversed, but not the specialization itself
+        if (type->isSugared())
+        {
+            TraverseType(type->desugar());
+        }
+        return true;
+    }
+
+    // e.g. enumerators in default arguments
+    bool VisitDeclRefExpr(clang::DeclRefExpr* expr)
+    {
+        found.push_back(expr->getDecl());
+        return true;
+    }
+};
+
+static void collectReferencedDecls(const clang::Decl* decl, std::vector<const clang::Decl*>& found)
+{
+    ReferencedDeclCollector collector(found);
+
+    // Functions, variables, fields, arguments, enumerators
+    if (const clang::ValueDecl* value = llvm::dyn_cast<clang::ValueDecl>(decl))
+    {
+        collector.TraverseType(value->getType());
+    }
+    if (const clang::FunctionDecl* function = llvm::dyn_cast<clang::FunctionDecl>(decl))
+    {
+        for (const clang::ParmVarDecl* param : function->params())
+        {
+            found.push_back(param);
+        }
+    }
+    if (const clang::ParmVarDecl* param = llvm::dyn_cast<clang::ParmVarDecl>(decl))
+    {
+        if (param->hasDefaultArg() && !param->hasUnparsedDefaultArg() && !param->hasUninstantiatedDefaultArg())
+        {
+            collector.TraverseStmt(const_cast<clang::Expr*>(param->getDefaultArg()));
+        }
+    }
+    if (const clang::TypedefNameDecl* typedef_decl = llvm::dyn_cast<clang::TypedefNameDecl>(decl))
+    {
+        collector.TraverseType(typedef_decl->getUnderlyingType());
+    }
+    if (const clang::EnumDecl* enum_decl = llvm::dyn_cast<clang::EnumDecl>(decl))
+    {
+        collector.TraverseType(enum_decl->getIntegerType());
+    }
+    if (const clang::CXXRecordDecl* record = llvm::dyn_cast<clang::CXXRecordDecl>(decl))
+    {
+        const clang::CXXRecordDecl* definition = record->getDefinition();
+        if (definition)
+        {
+            for (const clang::CXXBaseSpecifier& base : definition->bases())
+            {
+                collector.TraverseType(base.getType());
+            }
+        }
+    }
+    if (const clang::ClassTemplateSpecializationDecl* specialization = llvm::dyn_cast<clang::ClassTemplateSpecializationDecl>(decl))
+    {
+        found.push_back(specialization->getSpecializedTemplate());
+        const clang::TemplateArgumentList& args = specialization->getTemplateArgs();
+        for (unsigned idx = 0; idx < args.size(); ++idx)
+        {
+            collector.TraverseTemplateArgument(args.get(idx));
+        }
+    }
+    if (const clang::TemplateDecl* template_decl = llvm::dyn_cast<clang::TemplateDecl>(decl))
+    {
+        if (template_decl->getTemplatedDecl())
+        {
+            found.push_back(template_decl->getTemplatedDecl());
+        }
+        for (const clang::NamedDecl* param : *template_decl->getTemplateParameters())
+        {
+            found.push_back(param);
+        }
+    }
+    if (const clang::TemplateTypeParmDecl* param = llvm::dyn_cast<clang::TemplateTypeParmDecl>(decl))
+    {
+        if (param->hasDefaultArgument())
+        {
+            collector.TraverseType(param->getDefaultArgument());
+        }
+    }
+
+    // The translator only gets to a declaration through its parents
+    for (const clang::DeclContext* context = decl->getDeclContext();
+         context && !context->isTranslationUnit();
+         context = context->getParent())
+    {
+        found.push_back(clang::Decl::castFromDeclContext(context));
+    }
+}
+
+size_t markReachableDeclarations()
+{
+    std::vector<const clang::Decl*> worklist;
+    for (auto decl_pair : DeclVisitor::declarations)
+    {
+        if (decl_pair.second && decl_pair.second->shouldEmit())
+        {
+            worklist.push_back(decl_pair.first);
+        }
+    }
+
+    size_t count = 0;
+    std::unordered_set<const clang::Decl*> visited;
+    while (!worklist.empty())
+    {
+        const clang::Decl* decl = worklist.back();
+        worklist.pop_back();
+        if (!visited.insert(decl).second)
+        {
+            continue;
+        }
+
+        auto search_result = DeclVisitor::declarations.find(decl);
+        if (search_result == DeclVisitor::declarations.end())
+        {
+            search_result = DeclVisitor::declarations.find(decl->getCanonicalDecl());
+        }
+        if (search_result != DeclVisitor::declarations.end() && search_result->second)
+        {
+            Declaration* result = search_result->second;
+            if (!result->reachable)
+            {
+                result->reachable = true;
+                ++count;
+            }
+        }
+
+        collectReferencedDecls(decl, worklist);
+    }
+
+    statistics::reachable_declarations = count;
+    return count;
+}
+
+void wrapDeclarationsOutsideLazily(size_t count, char ** filenames)
+{
+    lazy_input_files = InputFiles(filenames, filenames + count);
 }
 
 void enableDeclarationsInFiles(size_t count, char ** filenames)
@@ -1345,6 +2073,7 @@ void DeclVisitor::enableDeclarationsInFiles(const std::vector<std::string>& file
     // so we have this special visitor that does work in WalkUpFromNamedDecl,
     // then aborts the traversal, and just aborts everything else
     FilenameVisitor visitor(begin(filename_vec), end(filename_vec));
+    statistics::input_files = filename_vec.size();
 
     for( auto decl_pair : DeclVisitor::declarations )
     {
@@ -1359,6 +2088,63 @@ void DeclVisitor::enableDeclarationsInFiles(const std::vector<std::string>& file
     }
 }
 
+namespace
+{
+    // Where a declaration appears in the headers, comparable across ASTs
+    struct HeaderPosition
+    {
+        Declaration* decl;
+        bool valid;
+        const char* filename;
+        unsigned line;
+        unsigned column;
+        size_t ast_index;
+
+        explicit HeaderPosition(Declaration* d)
+            : decl(d), valid(false), filename(""), line(0), column(0), ast_index(0)
+        {
+            clang::SourceLocation location = decl->getSourceLocation();
+            if (!location.isValid())
+            {
+                return;
+            }
+            const clang::SourceManager* sources = decl->getSourceManager();
+            clang::PresumedLoc presumed = sources->getPresumedLoc(location);
+            if (presumed.isInvalid())
+            {
+                return;
+            }
+            valid = true;
+            filename = presumed.getFilename();
+            line = presumed.getLine();
+            column = presumed.getColumn();
+            ast_index = std::find(traversed_sources.begin(), traversed_sources.end(), sources) - traversed_sources.begin();
+        }
+
+        bool operator<(const HeaderPosition& other) const
+        {
+            if (valid != other.valid)
+            {
+                return !valid;
+            }
+            int file_order = std::strcmp(filename, other.filename);
+            if (file_order != 0)
+            {
+                return file_order < 0;
+            }
+            if (line != other.line)
+            {
+                return line < other.line;
+            }
+            if (column != other.column)
+            {
+                return column < other.column;
+            }
+            return ast_index < other.ast_index;
+        }
+    };
+}
+
 void arrayOfFreeDeclarations(size_t* count, Declaration*** array)
 {
     if( !count || !array )
@@ -1373,22 +2159,39 @@ void arrayOfFreeDeclarations(size_t* count, Declaration*** array)
         counter ++;
     }
 
-    std::sort((*array), (*array) + counter,
-        [](Declaration * lhs, Declaration * rhs)
-        {
-            clang::SourceLocation left = lhs->getSourceLocation();
-            if (!left.isValid())
-            {
-                return true;
-            }
-            clang::SourceLocation right = rhs->getSourceLocation();
-            if (!right.isValid())
+    // std::sort needs every pair compared the same way.  Declarations
+    // without a location compare equal to each other, ahead of the rest.
+    if (traversed_sources.size() <= 1)
+    {
+        std::sort((*array), (*array) + counter,
+            [](Declaration * lhs, Declaration * rhs)
             {
-                return false;
+                clang::SourceLocation left = lhs->getSourceLocation();
+                clang::SourceLocation right = rhs->getSourceLocation();
+                if (!left.isValid() || !right.isValid())
+                {
+                    return !left.isValid() && right.isValid();
+                }
+                return lhs->getSourceManager()->isBeforeInTranslationUnit(left, right);
             }
-            return source_manager->isBeforeInTranslationUnit(left, right);
-        }
-        );
+            );
+        return;
+    }
+
+    // Locations in different ASTs cannot be compared with
+    // isBeforeInTranslationUnit, so with several ASTs every declaration is
+    // ordered by its position in the headers, and then by its AST.
+    std::vector<HeaderPosition> positions;
+    positions.reserve(counter);
+    for (size_t i = 0; i < counter; ++i)
+    {
+        positions.push_back(HeaderPosition((*array)[i]));
+    }
+    std::sort(positions.begin(), positions.end());
+    for (size_t i = 0; i < counter; ++i)
+    {
+        (*array)[i] = positions[i].decl;
+    }
 }
 
 Declaration * getDeclaration(const clang::Decl* decl)
@@ -1397,7 +2200,7 @@ Declaration * getDeclaration(const clang::Decl* decl)
     auto search_result = DeclVisitor::declarations.find(decl);
     if( search_result == DeclVisitor::declarations.end() )
     {
-        return nullptr;
+        return DeclVisitor::materialize(decl);
     }
     else
     {
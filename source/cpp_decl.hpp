@@ -19,10 +19,15 @@
 #ifndef __CPP_DECL_HPP__
 #define __CPP_DECL_HPP__
 
+#include <deque>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "llvm/ADT/APSInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/Allocator.h"
 
 #include "clang/AST/Decl.h"
 #include "clang/AST/RecursiveASTVisitor.h"
@@ -31,6 +36,12 @@
 #include "cpp_exception.hpp"
 #include "string.hpp"
 
+namespace clang
+{
+    class ASTUnit;
+    class SourceManager;
+}
+
 // TODO These are basically the same as the ones
 // in dlang_decls.hpp.  I should have a better model
 // for separating out attributes set from configuration files
@@ -61,16 +72,16 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
         bool isBoundSet;
         bool bound;
         bool isTargetModuleSet;
-        string target_module;
+        const string* target_module;
         // Visibility has an unset state
         Visibility visibility;
         // Empty string means no remove prefix
-        string remove_prefix;
+        const string* remove_prefix;
 
         public:
         DeclarationAttributes()
             : isBoundSet(false), bound(true), isTargetModuleSet(false),
-            target_module(), visibility(UNSET), remove_prefix()
+            target_module(emptyString()), visibility(UNSET), remove_prefix(emptyString())
         { }
 
         static DeclarationAttributes* make();
@@ -94,19 +105,26 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
         // Attributes!
         // Pointer to D declaration!
         bool should_emit;
-        string target_module;
+        // Names are interned, see binder::intern
+        const string* target_module;
         Visibility visibility;
-        string remove_prefix;
+        const string* remove_prefix;
 
         protected:
-        string source_name;
-        string _name;
+        const string* source_name;
+        const string* _name;
+        // The SourceManager of the AST this declaration was first found in
+        const clang::SourceManager* sources;
+        // Whether an emitted declaration depends on this one; see
+        // markReachableDeclarations
+        bool reachable;
 
         virtual void setSourceName(string* name) {
-            source_name = *name;
+            source_name = intern(*name);
         }
 
         friend class DeclVisitor;
+        friend size_t markReachableDeclarations();
 
         virtual void markUnwrappable() {
             is_wrappable = false;
@@ -114,25 +132,32 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
 
         public:
         Declaration()
-            : is_wrappable(true), should_emit(false), target_module(),
-              visibility(UNSET), remove_prefix(), source_name(), _name()
+            : is_wrappable(true), should_emit(false), target_module(emptyString()),
+              visibility(UNSET), remove_prefix(emptyString()), source_name(emptyString()), _name(emptyString()),
+              sources(nullptr), reachable(false)
         { }
 
         virtual clang::SourceLocation getSourceLocation() const = 0;
+        // Interprets the result of getSourceLocation()
+        const clang::SourceManager* getSourceManager() const
+        {
+            return sources;
+        }
 
-        virtual string* getSourceName() const
+        // The names are interned, so callers can hold on to them
+        virtual const string* getSourceName() const
         {
-            return new string(source_name);
+            return source_name;
         }
-        virtual string* getTargetName() const
+        virtual const string* getTargetName() const
         {
-            if (_name.size() == 0)
+            if (_name->size() == 0)
             {
-                return new string(source_name);
+                return source_name;
             }
             else
             {
-                return new string(_name);
+                return _name;
             }
         }
 
@@ -153,16 +178,16 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
 
         virtual void setTargetModule(string* target)
         {
-            target_module = *target;
+            target_module = intern(*target);
         }
 
         virtual bool isTargetModuleSet() const
         {
-            return target_module.size() > 0;
+            return target_module->size() > 0;
         }
-        virtual string* getTargetModule() const
+        virtual const string* getTargetModule() const
         {
-            return new string(target_module);
+            return target_module;
         }
 
         virtual ::Visibility getVisibility() const
@@ -176,11 +201,12 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
 
         virtual void removePrefix(string* prefix)
         {
-            remove_prefix = *prefix;
+            remove_prefix = intern(*prefix);
         }
 
         // This is for the configuration pass, so it can look up decls,
-        // then apply attributes to their types
+        // then apply attributes to their types.
+        // Declarations that are not types return null.
         // TODO split into TypeDeclarations and other declarations?
         virtual Type* getType() const = 0;
         virtual Type* getTargetType() const
@@ -194,18 +220,12 @@ Visibility accessSpecToVisibility(clang::AccessSpecifier as);
         virtual void dump() = 0;
 
         void applyAttributes(const DeclarationAttributes* attribs);
+        bool isReachable() const;
     };
 
     void applyAttributesToDeclByName(const DeclarationAttributes* attribs, const string* declName);
     Declaration * getDeclaration(const clang::Decl* decl);
 
-    struct NotTypeDecl : public std::runtime_error
-    {
-        NotTypeDecl()
-            : std::runtime_error("Operation is only valid on Type declarations.")
-        { }
-    };
-
     /*template<typename ClangType, typename TranslatorType>
     class Iterator
     {
@@ -320,7 +340,7 @@ func(Unwrappable)
 \
         virtual Type* getType() const override \
         { \
-            throw NotTypeDecl(); \
+            return nullptr; \
         }\
 \
         virtual void visit(DeclarationVisitor& visitor) override \
@@ -416,14 +436,51 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         }
     };
 
+    // The registered declarations in one or more DeclContexts, each once,
+    // in the order they were declared.  These are collected after the
+    // traversal so that walking the children doesn't look each one up.
+    class ChildDeclarations
+    {
+        std::vector<Declaration*> children;
+        bool built;
+
+        public:
+        ChildDeclarations()
+            : children(), built(false)
+        { }
+
+        void build(const std::vector<const clang::DeclContext*>& contexts);
+        // Something was registered in one of the contexts after they were built
+        void invalidate()
+        {
+            built = false;
+        }
+
+        bool isBuilt() const
+        {
+            return built;
+        }
+        size_t size() const
+        {
+            return children.size();
+        }
+        Declaration** data()
+        {
+            return children.data();
+        }
+    };
+
     class NamespaceDeclaration : public Declaration
     {
         private:
         const clang::NamespaceDecl* _decl;
+        // The same namespace as seen by other ASTs, when parsing in shards
+        std::vector<const clang::NamespaceDecl*> merged_decls;
+        ChildDeclarations children;
 
         public:
         NamespaceDeclaration(const clang::NamespaceDecl* d)
-            : _decl(d)
+            : _decl(d), children()
         { }
 
         virtual clang::SourceLocation getSourceLocation() const override
@@ -433,7 +490,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
 
         virtual Type* getType() const override
         {
-            throw NotTypeDecl();
+            return nullptr;
         }
 
         virtual void visit(DeclarationVisitor& visitor) override
@@ -451,6 +508,17 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         {
             _decl->dump();
         }
+
+        void addMergedDecl(const clang::NamespaceDecl* d);
+
+        // The children of every redeclaration, including merged ones
+        void buildChildren();
+        void invalidateChildren()
+        {
+            children.invalidate();
+        }
+        size_t getChildCount();
+        Declaration** getChildArray();
     };
 
     class TypedefDeclaration : public Declaration
@@ -632,7 +700,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         virtual Type* getType() const override
         {
             // TODO in principle, this should probably return a function type
-            throw NotTypeDecl();
+            return nullptr;
         }
 
         virtual void visit(DeclarationVisitor& visitor) override
@@ -783,7 +851,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
 
         virtual Type* getType() const override
         {
-            throw NotTypeDecl();
+            return nullptr;
         }
 
         virtual void visit(DeclarationVisitor& visitor) override
@@ -949,6 +1017,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
     {
         protected:
         const clang::RecordDecl* _decl;
+        ChildDeclarations children;
 
         const clang::RecordDecl* definitionOrThis() const
         {
@@ -965,7 +1034,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
 
         public:
         RecordDeclaration(const clang::RecordDecl* d)
-            : _decl(d)
+            : _decl(d), children()
         { }
 
         virtual clang::SourceLocation getSourceLocation() const override
@@ -998,6 +1067,9 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         {
             return new DeclarationRange(definitionOrThis()->decls());
         }
+        void buildChildren();
+        size_t getChildCount();
+        Declaration** getChildArray();
 
         virtual MethodRange * getMethodRange()
         {
@@ -1072,10 +1144,11 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
     {
         private:
         const clang::RecordDecl* _decl;
+        ChildDeclarations children;
 
         public:
         UnionDeclaration(const clang::RecordDecl* d)
-            : _decl(d)
+            : _decl(d), children()
         { }
 
         virtual clang::SourceLocation getSourceLocation() const override
@@ -1109,6 +1182,9 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         {
             return new DeclarationRange(_decl->decls());
         }
+        void buildChildren();
+        size_t getChildCount();
+        Declaration** getChildArray();
 
         virtual void dump() override
         {
@@ -1468,7 +1544,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
 
         virtual Type* getType() const override
         {
-            throw NotTypeDecl();
+            return nullptr;
         }
 
         virtual void visit(DeclarationVisitor& visitor) override
@@ -1496,13 +1572,24 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         void allocateDeclaration(SourceType * decl)
         {
             auto search_result = declarations.find(decl->getCanonicalDecl());
-            if (search_result == declarations.end())
+            if (search_result != declarations.end())
             {
-                decl_in_progress = new TargetType(reinterpret_cast<SourceType*>(decl));
+                decl_in_progress = search_result->second;
+            }
+            else if (merging_asts && (decl_in_progress = findMergedDeclaration(decl)))
+            {
+                // Already seen while traversing another AST
             }
             else
             {
-                decl_in_progress = search_result->second;
+                void* memory = declaration_arena.Allocate(sizeof(TargetType), alignof(TargetType));
+                decl_in_progress = new (memory) TargetType(reinterpret_cast<SourceType*>(decl));
+                arena_declarations.push_back(decl_in_progress);
+                decl_in_progress->sources = &decl->getASTContext().getSourceManager();
+                if (merging_asts)
+                {
+                    recordMergedDeclaration(decl, decl_in_progress);
+                }
             }
             declarations.insert(std::make_pair(decl, decl_in_progress));
             bool isCanonical = (decl->getCanonicalDecl() == decl);
@@ -1516,15 +1603,55 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
             }
         }
 
-        bool registerDeclaration(clang::Decl* cppDecl, bool top_level = false, clang::TemplateParameterList * tl = nullptr);
+        bool registerDeclaration(clang::Decl* cppDecl, bool top_level = false, clang::TemplateParameterList * tl = nullptr, Declaration* owner = nullptr);
+
+        // Child declarations are queued here and traversed one at a time
+        // instead of recursively, so deeply nested code can't overflow the stack.
+        struct PendingDeclaration
+        {
+            clang::Decl* decl;
+            bool top_level;
+            clang::TemplateParameterList* template_list;
+            // Can't be wrapped if this declaration can't be, e.g. a method
+            // whose argument this is
+            Declaration* owner;
+        };
+        static std::deque<PendingDeclaration> pending_declarations;
+        static bool traversing_pending;
+        void traversePendingDeclarations();
+
+        // Wraps a declaration that the traversal skipped because it wasn't
+        // in an input file, along with whatever it was declared inside of
+        static Declaration* materialize(const clang::Decl* decl);
+
+        // Every Declaration lives here, so that they are close together.
+        // They last as long as the process does.
+        static llvm::BumpPtrAllocator declaration_arena;
+        // In the order they were allocated
+        static std::vector<Declaration*> arena_declarations;
 
         // All declarations ever
-        static std::unordered_map<const clang::Decl*, Declaration*> declarations;
+        typedef llvm::DenseMap<const clang::Decl*, Declaration*> DeclarationMap;
+        static DeclarationMap declarations;
+        // Makes room for expected more declarations all at once
+        static void reserveDeclarations(size_t expected);
         // Root level declarations, i.e. top level functions, namespaces, etc.
         static std::unordered_set<Declaration*> free_declarations;
 
+        // When the headers are parsed as several ASTs, the same entity
+        // shows up once per AST.  These are matched up by USR so that
+        // each entity gets exactly one Declaration.
+        static bool merging_asts;
+        static std::unordered_map<std::string, Declaration*> declarations_by_usr;
+        static Declaration* findMergedDeclaration(const clang::Decl* decl);
+        static void recordMergedDeclaration(const clang::Decl* decl, Declaration* result);
+        static void startMerging();
+
         bool top_level_decls;
         Declaration* decl_in_progress;
+        // Set when the traversal stops because the declaration can't be
+        // wrapped and there is no Declaration yet to mark as unwrappable
+        bool skipped_unwrappable;
         const clang::PrintingPolicy* print_policy;
         clang::TemplateParameterList * template_list;
 
@@ -1623,7 +1750,7 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         private:
         static void enableDeclarationsInFiles(const std::vector<std::string>& filenames);
 
-        static const std::unordered_map<const clang::Decl*, Declaration*>& getDeclarations()
+        static const DeclarationMap& getDeclarations()
         {
             return declarations;
         }
@@ -1632,12 +1759,16 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
             return free_declarations;
         }
 
+        friend void traverseDeclsInAST(clang::ASTUnit* ast);
         friend void enableDeclarationsInFiles(size_t count, char ** filenames);
         friend void arrayOfFreeDeclarations(size_t* count, Declaration*** array);
+        friend double declarationLookupsPerSecond();
+        friend size_t markReachableDeclarations();
         friend Declaration * getDeclaration(const clang::Decl* decl);
         friend class RecordDeclaration;
         friend class SpecializedRecordDeclaration;
         friend class DeclarationRange;
+        friend class ChildDeclarations;
         friend class ArgumentIterator;
         friend class FieldRange;
         friend class MethodRange;
@@ -1646,20 +1777,23 @@ DECLARATION_CLASS_2(CXXDestructor, Destructor);
         friend class SpecializedRecordRange;
     };
 
-namespace clang
-{
-    class ASTUnit;
-}
+    // Before traversing: declarations at namespace scope outside of these
+    // files are only wrapped when something looks them up
+    void wrapDeclarationsOutsideLazily(size_t count, char ** filenames);
     void traverseDeclsInAST(clang::ASTUnit* ast);
     void enableDeclarationsInFiles(size_t count, char ** filenames);
     void arrayOfFreeDeclarations(size_t* count, Declaration*** array);
-
-    class SkipUnwrappableDeclaration : public NotWrappableException
-    {
-        public:
-        SkipUnwrappableDeclaration(clang::Decl*)
-        { }
-    };
+    // Times lookups of every registered declaration, for --bench-lookups
+    double declarationLookupsPerSecond();
+    // Marks the emitted declarations, everything they refer to through
+    // their types, bases, typedefs, and template arguments, and the
+    // namespaces and records that contain any of those.  Only these need
+    // to be translated.  Returns how many were marked.
+    size_t markReachableDeclarations();
+
+    // Computes the clang USR used to match entities across ASTs.
+    // Returns false for declarations that do not have one.
+    bool getMergeKey(const clang::Decl* decl, std::string& key);
 
 //} // namespace cpp
 
@@ -31,10 +31,70 @@
 #include "cpp_decl.hpp"
 #include "cpp_expr.hpp"
 #include "nested_name_resolver.hpp"
+#include "statistics.hpp"
 //using namespace cpp;
 
 std::unordered_map<const clang::QualType, Type*> Type::type_map;
-std::unordered_multimap<string, Type*> Type::type_by_name;
+std::unordered_multimap<const string*, Type*> Type::type_by_name;
+bool Type::merging_asts = false;
+std::unordered_map<std::string, Type*> Type::types_by_usr;
+
+static const clang::NamedDecl* declForMerging(const clang::Type* type)
+{
+    if (const clang::TagType* tag = llvm::dyn_cast<clang::TagType>(type))
+    {
+        return tag->getDecl();
+    }
+    else if (const clang::TypedefType* typedef_type = llvm::dyn_cast<clang::TypedefType>(type))
+    {
+        return typedef_type->getDecl();
+    }
+    return nullptr;
+}
+
+Type* Type::findMergedType(const clang::Type* type)
+{
+    const clang::NamedDecl* decl = declForMerging(type);
+    std::string usr;
+    if (!decl || !getMergeKey(decl, usr))
+    {
+        return nullptr;
+    }
+
+    auto search_result = types_by_usr.find(usr);
+    if (search_result == types_by_usr.end())
+    {
+        return nullptr;
+    }
+    return search_result->second;
+}
+
+void Type::recordMergedType(const clang::Type* type, Type* result)
+{
+    const clang::NamedDecl* decl = declForMerging(type);
+    std::string usr;
+    if (decl && getMergeKey(decl, usr))
+    {
+        types_by_usr.insert(std::make_pair(usr, result));
+    }
+}
+
+void Type::startMerging()
+{
+    if (merging_asts)
+    {
+        return;
+    }
+
+    merging_asts = true;
+    for (auto type_pair : type_map)
+    {
+        if (!type_pair.first.hasLocalQualifiers() && type_pair.first.getTypePtrOrNull())
+        {
+            recordMergedType(type_pair.first.getTypePtr(), type_pair.second);
+        }
+    }
+}
 
 TypeAttributes* TypeAttributes::make()
 {
@@ -53,19 +113,19 @@ void TypeAttributes::setStrategy(Strategy s)
 
 void TypeAttributes::setTargetName(string* new_target)
 {
-    target_name = *new_target;
+    target_name = intern(*new_target);
 }
 
 void TypeAttributes::setTargetModule(string* new_module)
 {
-    target_module = *new_module;
+    target_module = intern(*new_module);
 }
 
 void Type::printTypeNames()
 {
     for( auto p : type_by_name )
     {
-        std::cout << p.first << "\n";
+        std::cout << *p.first << "\n";
     }
 }
 
@@ -100,19 +160,35 @@ Type* Type::get(const clang::QualType& qType, const clang::PrintingPolicy* print
     }
 
     ClangTypeVisitor type_visitor(printPolicy);
-    type_visitor.TraverseType(qType);
+    Type* result = type_visitor.translate(qType);
+    if( result )
+    {
+        return result;
+    }
 
-    if( type_map.find(qType) == type_map.end() )
+    // Only types that cannot be resolved, like an undeduced auto, map to null
+    iter = type_map.find(qType);
+    if( iter == type_map.end() )
     {
         qType.dump();
         throw std::logic_error("FATAL: Traversing a clang::QualType did not place it into the type map!");
     }
-    return type_map.find(qType)->second;
+    return iter->second;
 }
 
 Type::range_t Type::getByName(const string* name)
 {
-    range_t search = type_by_name.equal_range(*name);
+    return getByName(name->c_str(), name->size());
+}
+
+Type::range_t Type::getByName(const char* name, size_t length)
+{
+    // A name that was never interned can't name a type
+    const string* interned = findInterned(name, length);
+    if( !interned ) {
+        return range_t();
+    }
+    range_t search = type_by_name.equal_range(interned);
     if( search.first != Type::type_by_name.end() ) {
         return search;
     }
@@ -131,36 +207,34 @@ Strategy Type::getStrategy() const
     return strategy;
 }
 
-string* Type::getReplacement() const
+const string* Type::getReplacement() const
 {
     if( strategy != REPLACE )
     {
         throw WrongStrategy();
     }
-    string * result = new string(target_name);
-    return result;
+    return target_name;
 }
 
-string* Type::getReplacementModule() const
+const string* Type::getReplacementModule() const
 {
     if( strategy != REPLACE )
     {
         throw WrongStrategy();
     }
-    string * result = new string(target_module);
-    return result;
+    return target_module;
 }
 
-void Type::setReplacementModule(string new_mod)
+void Type::setReplacementModule(const string* new_mod)
 {
-    target_module = new_mod;
+    target_module = intern(*new_mod);
 }
 
 void Type::applyAttributes(const TypeAttributes* attribs)
 {
     if (attribs->strategy == REPLACE)
     {
-        chooseReplaceStrategy(&attribs->target_name);
+        chooseReplaceStrategy(attribs->target_name);
     }
     else if (attribs->strategy != UNKNOWN)
     {
@@ -178,7 +252,7 @@ bool BuiltinType::hasDeclaration() const
 bool BuiltinType::isWrappable(bool)
 {
     return type->getKind() != clang::BuiltinType::Dependent
-        && target_name.size() > 0;
+        && target_name->size() > 0;
 }
 
 Type * QualifiedType::unqualifiedType()
@@ -237,7 +311,7 @@ bool RecordType::isReferenceType() const
         case REPLACE:
             // If we were explicitly given a name for the replacement type,
             // then we use that text without modification.
-            if (target_name.size() > 0)
+            if (target_name->size() > 0)
             {
                 return false;
             }
@@ -915,15 +989,49 @@ void TemplateArgumentInstanceIterator::dumpPackInfo()
 
 ClangTypeVisitor::ClangTypeVisitor(const clang::PrintingPolicy* pp)
     : clang::RecursiveASTVisitor<ClangTypeVisitor>(),
-    type_to_traverse(nullptr), type_in_progress(nullptr),
+    type_to_traverse(), translated(nullptr), type_in_progress(nullptr),
     printPolicy(pp)
 { }
 
+Type* ClangTypeVisitor::translate(clang::QualType type)
+{
+    type_to_traverse = type;
+    translated = nullptr;
+    traverseUncachedType(type);
+    return translated;
+}
+
 bool ClangTypeVisitor::TraverseType(clang::QualType type)
 {
     if( Type::type_map.find(type) != Type::type_map.end() )
         return true;
 
+    return traverseUncachedType(type);
+}
+
+// Sugar that is not a typedef or a template specialization means the same
+// thing as the type underneath it, so it shares that type's Type instead of
+// being analyzed and translated again.  Typedefs keep their own Type so that
+// the output can use their names.
+// Returns a null QualType for anything else, including sugar that cannot be
+// resolved yet because it is dependent.
+static clang::QualType namelessSugarTarget(const clang::Type* type)
+{
+    if (llvm::isa<clang::TypedefType>(type) || llvm::isa<clang::TemplateSpecializationType>(type))
+    {
+        return clang::QualType();
+    }
+
+    clang::QualType underneath = type->getLocallyUnqualifiedSingleStepDesugaredType();
+    if (underneath.getTypePtrOrNull() == type)
+    {
+        return clang::QualType();
+    }
+    return underneath;
+}
+
+bool ClangTypeVisitor::traverseUncachedType(clang::QualType type)
+{
     bool result;
     if (type.isLocalConstQualified())
     {
@@ -947,8 +1055,8 @@ bool ClangTypeVisitor::TraverseType(clang::QualType type)
         // restrict is (I think) just an optimization
         clang::QualType unqual = type;
         unqual.removeLocalRestrict();
-        result = TraverseType(unqual);
-        Type::type_map.insert(std::make_pair(type, Type::get(unqual)));
+        recordType(type, Type::get(unqual, printPolicy));
+        result = true;
     }
     else if (!type.getLocalQualifiers().empty())
     {
@@ -959,29 +1067,60 @@ bool ClangTypeVisitor::TraverseType(clang::QualType type)
     }
     else
     {
-        result = Super::TraverseType(type);
+        clang::QualType underneath = namelessSugarTarget(type.getTypePtr());
+        if (underneath.isNull())
+        {
+            result = Super::TraverseType(type);
+        }
+        else
+        {
+            type_in_progress = recordType(type, Type::get(underneath, printPolicy));
+            ++statistics::sugared_types;
+            result = true;
+        }
     }
 
     return result;
 }
 
+Type* ClangTypeVisitor::recordType(const clang::QualType& t, Type* type)
+{
+    auto inserted = Type::type_map.insert(std::make_pair(t, type));
+    if (t == type_to_traverse)
+    {
+        translated = inserted.first->second;
+    }
+    return inserted.first->second;
+}
+
 void ClangTypeVisitor::allocateInvalidType(const clang::QualType& t)
 {
     type_in_progress = new InvalidType(t);
-    Type::type_map.insert(std::make_pair(t, type_in_progress));
+    recordType(t, type_in_progress);
+    ++statistics::types;
 }
 
 void ClangTypeVisitor::allocateQualType(const clang::QualType t)
 {
     type_in_progress = new QualifiedType(t);
-    Type::type_map.insert(std::make_pair(t, type_in_progress));
+    recordType(t, type_in_progress);
+    ++statistics::types;
 }
 
 template<typename T, typename ClangType>
 void ClangTypeVisitor::allocateType(const ClangType* t)
 {
-    type_in_progress = new T(t);
-    Type::type_map.insert(std::make_pair(clang::QualType(t, 0), type_in_progress));
+    type_in_progress = Type::merging_asts ? Type::findMergedType(t) : nullptr;
+    if (!type_in_progress)
+    {
+        type_in_progress = new T(t);
+        ++statistics::types;
+        if (Type::merging_asts)
+        {
+            Type::recordMergedType(t, type_in_progress);
+        }
+    }
+    recordType(clang::QualType(t, 0), type_in_progress);
 }
 
 #define WALK_UP_METHOD(KIND) \
@@ -1085,8 +1224,8 @@ bool ClangTypeVisitor::WalkUpFromType(clang::Type* type)
 bool ClangTypeVisitor::VisitBuiltinType(clang::BuiltinType* cppType)
 {
     assert(printPolicy != nullptr);
-    string name = cppType->getName(*printPolicy).data();
-    Type::type_by_name.insert(std::make_pair(name, type_in_progress));
+    llvm::StringRef name = cppType->getName(*printPolicy);
+    Type::type_by_name.insert(std::make_pair(intern(name.data(), name.size()), type_in_progress));
     return true;
 }
 
@@ -1151,49 +1290,12 @@ bool ClangTypeVisitor::VisitTypedefType(clang::TypedefType* cppType)
     return real_visitor.TraverseType(cppType->desugar());
 }
 
-bool ClangTypeVisitor::WalkUpFromElaboratedType(clang::ElaboratedType* type)
-{
-    //bool result = TraverseType(type->getNamedType());
-    // TODO nullptr
-    Type* t = Type::get(type->getNamedType(), printPolicy);
-    // FIXME does this really need to go into the map here?  Does that happen during TraverseType?
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), t));
-    type_in_progress = t;
-    return Super::WalkUpFromElaboratedType(type);
-}
-
-bool ClangTypeVisitor::WalkUpFromDecayedType(clang::DecayedType* type)
-{
-    bool result = TraverseType(type->getDecayedType());
-    // TODO nullptr
-    Type* t = Type::type_map.find(type->getDecayedType())->second;
-    // FIXME does this really need to go into the map here?  Does that happen during TraverseType?
-    Type::type_map.insert(std::make_pair(type->getDecayedType(), t));
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), t));
-    return result;
-}
-
-bool ClangTypeVisitor::WalkUpFromParenType(clang::ParenType* type)
-{
-    bool result = TraverseType(type->getInnerType());
-    // TODO nullptr
-    Type* t = Type::type_map.find(type->getInnerType())->second;
-    // FIXME does this really need to go into the map here?
-    Type::type_map.insert(std::make_pair(type->getInnerType(), t));
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), t));
-    return result;
-}
-
 bool ClangTypeVisitor::WalkUpFromDecltypeType(clang::DecltypeType* type)
 {
-    bool result = TraverseType(type->getUnderlyingType());
-    // TODO nullptr
-    Type* t = Type::type_map.find(type->getUnderlyingType())->second;
-    // FIXME does this really need to go into the map here?
-    Type::type_map.insert(std::make_pair(type->getUnderlyingType(), t));
     // TODO is resolving the decltype the best thing to do here?
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), t));
-    return result;
+    Type* t = Type::get(type->getUnderlyingType(), printPolicy);
+    recordType(clang::QualType(type, 0), t);
+    return true;
 }
 
 bool ClangTypeVisitor::WalkUpFromTemplateSpecializationType(clang::TemplateSpecializationType* type)
@@ -1201,9 +1303,7 @@ bool ClangTypeVisitor::WalkUpFromTemplateSpecializationType(clang::TemplateSpeci
     // TODO
     allocateType<TemplateSpecializationType>(type);
     std::string name = type->getTemplateName().getAsTemplateDecl()->getQualifiedNameAsString();
-    // TODO Make sure I'm not making too many of these!
-    string binder_name(name.c_str(), name.size());
-    Type::type_by_name.insert(std::make_pair(binder_name, type_in_progress));
+    Type::type_by_name.insert(std::make_pair(intern(name.c_str(), name.size()), type_in_progress));
     return Super::WalkUpFromTemplateSpecializationType(type);
 }
 
@@ -1245,14 +1345,7 @@ bool ClangTypeVisitor::WalkUpFromDependentNameType(clang::DependentNameType* typ
 bool ClangTypeVisitor::WalkUpFromTypeOfExprType(clang::TypeOfExprType* type)
 {
     Type * deduced = Type::get(type->getUnderlyingExpr()->getType(), printPolicy);
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), deduced));
-    return true;
-}
-
-bool ClangTypeVisitor::WalkUpFromSubstTemplateTypeParmType(clang::SubstTemplateTypeParmType* type)
-{
-    Type* underneath = Type::get(type->desugar(), printPolicy);
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), underneath));
+    recordType(clang::QualType(type, 0), deduced);
     return true;
 }
 
@@ -1284,6 +1377,6 @@ bool ClangTypeVisitor::WalkUpFromPackExpansionType(clang::PackExpansionType* typ
 bool ClangTypeVisitor::WalkUpFromAutoType(clang::AutoType* type)
 {
     Type * deduced = Type::get(type->getDeducedType(), printPolicy);
-    Type::type_map.insert(std::make_pair(clang::QualType(type, 0), deduced));
+    recordType(clang::QualType(type, 0), deduced);
     return true;
 }
@@ -20,6 +20,7 @@
 #define __CPP_TYPE_HPP__
 
 #include <memory>
+#include <string>
 #include <unordered_map>
 
 #include "clang/AST/Type.h"
@@ -64,12 +65,12 @@ class Expression;
     class TypeAttributes
     {
         Strategy strategy;
-        string target_name;
-        string target_module;
+        const string* target_name;
+        const string* target_module;
 
         public:
         TypeAttributes()
-            : strategy(UNKNOWN), target_name(""), target_module("")
+            : strategy(UNKNOWN), target_name(emptyString()), target_module(emptyString())
         { }
 
         static TypeAttributes * make();
@@ -131,19 +132,30 @@ class Expression;
         // Attributes! from config files or inferred
         // Pointer to D type!
         Strategy strategy;
-        string target_name;
-        string target_module; // only meaningful for types using the replacement strategy
-                              // This is kind of a kludge to deal with builtins.  FIXME?
+        // Names are interned, see binder::intern
+        const string* target_name;
+        const string* target_module; // only meaningful for types using the replacement strategy
+                                     // This is kind of a kludge to deal with builtins.  FIXME?
 
 
         static std::unordered_map<const clang::QualType, Type*> type_map;
-        static std::unordered_multimap<string, Type*> type_by_name;
+        // Keyed by interned name
+        static std::unordered_multimap<const string*, Type*> type_by_name;
+
+        // Types that name a declaration (records, enums, typedefs) are
+        // shared between ASTs the same way the declarations are.
+        // See DeclVisitor::declarations_by_usr.
+        static bool merging_asts;
+        static std::unordered_map<std::string, Type*> types_by_usr;
+        static Type* findMergedType(const clang::Type* type);
+        static void recordMergedType(const clang::Type* type, Type* result);
 
         public:
         static void printTypeNames();
+        static void startMerging();
         explicit Type(Kind k)
-            : kind(k), strategy(UNKNOWN), target_name(""),
-              target_module("")
+            : kind(k), strategy(UNKNOWN), target_name(emptyString()),
+              target_module(emptyString())
         { }
 
         Type(const Type&) = delete;
@@ -154,9 +166,10 @@ class Expression;
         static Type* get(const clang::Type* type, const clang::PrintingPolicy* pp = nullptr);
         static Type* get(const clang::QualType& qType, const clang::PrintingPolicy* pp = nullptr);
 
-        typedef std::unordered_multimap<string, Type*>::iterator iter_t;
+        typedef std::unordered_multimap<const string*, Type*>::iterator iter_t;
         typedef std::pair<iter_t, iter_t> range_t;
         static range_t getByName(const string* name);
+        static range_t getByName(const char* name, size_t length);
 
         Kind getKind() const;
 
@@ -165,7 +178,7 @@ class Expression;
         void chooseReplaceStrategy(const string* replacement)
         {
             strategy = REPLACE;
-            target_name = *replacement;
+            target_name = intern(*replacement);
         }
 
         struct DontSetUnknown : public std::runtime_error
@@ -206,9 +219,10 @@ class Expression;
                 : std::runtime_error("That operation is only valid for types with a different translation strategy.")
             { }
         };
-        string* getReplacement() const;
-        string* getReplacementModule() const;
-        void setReplacementModule(string mod);
+        // Interned, like the names of declarations
+        const string* getReplacement() const;
+        const string* getReplacementModule() const;
+        void setReplacementModule(const string* mod);
 
         virtual bool hasDeclaration() const = 0;
         virtual Declaration * getDeclaration() const
@@ -871,8 +885,9 @@ class Expression;
     class ClangTypeVisitor : public clang::RecursiveASTVisitor<ClangTypeVisitor>
     {
         private:
-        // The TypeVisitor does not own this pointer
-        const clang::Type * type_to_traverse;
+        // The type passed to translate, and the Type it ended up with
+        clang::QualType type_to_traverse;
+        Type* translated;
         Type* type_in_progress;
         const clang::PrintingPolicy* printPolicy; // Used for generating names of the type
 
@@ -880,6 +895,11 @@ class Expression;
         void allocateType(const ClangType* t);
         void allocateInvalidType(const clang::QualType& t);
         void allocateQualType(const clang::QualType t);
+        // Every insertion into Type::type_map goes through here.
+        // Returns the Type that t maps to, which is the one already there
+        // if something else got to t first.
+        Type* recordType(const clang::QualType& t, Type* type);
+        bool traverseUncachedType(clang::QualType type);
         public:
         typedef clang::RecursiveASTVisitor<ClangTypeVisitor> Super;
 
@@ -890,10 +910,15 @@ class Expression;
         }
 
         void reset() {
-            type_to_traverse = nullptr;
+            type_to_traverse = clang::QualType();
+            translated = nullptr;
             type_in_progress = nullptr;
         }
 
+        // For types that are not in Type::type_map yet.
+        // Returns the Type that type now maps to, without looking it up again.
+        Type* translate(clang::QualType type);
+
         bool TraverseType(clang::QualType type);
         // Game plan here is to allocate the object during
         // the WalkUp phase, since that starts with the most
@@ -910,15 +935,13 @@ class Expression;
         bool WalkUpFromEnumType(clang::EnumType * type);
         bool WalkUpFromFunctionProtoType(clang::FunctionProtoType* type);
 
-        // These are sugar / slight modifications of other types
-        // We just pass though them
-        bool WalkUpFromElaboratedType(clang::ElaboratedType* cppType);
-        bool WalkUpFromDecayedType(clang::DecayedType* cppType);
-        bool WalkUpFromParenType(clang::ParenType* cppType);
+        // Sugar that does not name anything (parentheses, elaborated
+        // names, decayed arrays, deduced types, and so on) never gets
+        // here; TraverseType gives it the Type of whatever it desugars to.
+        // These are the dependent forms, which cannot be desugared.
         bool WalkUpFromDecltypeType(clang::DecltypeType* cppType);
         bool WalkUpFromAutoType(clang::AutoType* type);
         bool WalkUpFromTypeOfExprType(clang::TypeOfExprType* type);
-        bool WalkUpFromSubstTemplateTypeParmType(clang::SubstTemplateTypeParmType* type);
         bool WalkUpFromDependentNameType(clang::DependentNameType* type);
 
         // Types we can't handle yet
@@ -966,65 +989,6 @@ class Expression;
             return type;
         }
     };
-
-    // Catching a "Skip" subclass means that we (temporarily)
-    // aren't translating that type, but should continue with the
-    // other parts of the translation.
-    class SkipUnwrappableType : public NotWrappableException
-    {
-        private:
-        const clang::Type * type;
-
-        // TODO figure out how to print types as strings,
-        // so I can make sensible messages
-        public:
-        SkipUnwrappableType(const clang::Type* t)
-            : NotWrappableException(), type(t)
-        { }
-
-        virtual const clang::Type * getType() const {
-            return type;
-        }
-    };
-
-    class SkipRValueRef : public SkipUnwrappableType
-    {
-        public:
-        SkipRValueRef(const clang::RValueReferenceType* t)
-            : SkipUnwrappableType(t)
-        { }
-
-        virtual const char * what() const noexcept override
-        {
-            return "Skipping type due to rvalue reference.";
-        }
-    };
-
-    class SkipTemplate : public SkipUnwrappableType
-    {
-        public:
-        SkipTemplate(const clang::Type* t)
-            : SkipUnwrappableType(t)
-        { }
-
-        virtual const char * what() const noexcept override
-        {
-            return "Skipping type since it is dependent on a template.";
-        }
-    };
-
-    class SkipMemberPointer : public SkipUnwrappableType
-    {
-        public:
-        SkipMemberPointer(const clang::MemberPointerType* t)
-            : SkipUnwrappableType(t)
-        { }
-
-        virtual const char * what() const noexcept override
-        {
-            return "Skipping type due to a C++ member pointer.";
-        }
-    };
 //} namespace cpp
 
 #endif // __CPP_TYPE_HPP__
@@ -0,0 +1,66 @@
+/*
+ *  cpp_binder: an automatic C++ binding generator for D
+ *  Copyright (C) 2016 Paul O'Neil <redballoon36@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+
+#include "statistics.hpp"
+
+size_t statistics::skipped_function_bodies = 0;
+size_t statistics::declarations = 0;
+size_t statistics::declaration_bytes = 0;
+size_t statistics::reachable_declarations = 0;
+size_t statistics::deferred_declarations = 0;
+size_t statistics::materialized_declarations = 0;
+size_t statistics::unwrappable_declarations = 0;
+size_t statistics::types = 0;
+size_t statistics::sugared_types = 0;
+size_t statistics::input_files = 0;
+size_t statistics::emit_filter_checks = 0;
+size_t statistics::emit_filter_file_lookups = 0;
+
+void printTraversalStatistics()
+{
+    std::cerr << "  clang declarations registered: " << statistics::declarations << "\n";
+    std::cerr << "  declarations outside the inputs skipped: " << statistics::deferred_declarations << "\n";
+    std::cerr << "  skipped declarations wrapped on demand: " << statistics::materialized_declarations << "\n";
+    std::cerr << "  unwrappable declarations skipped: " << statistics::unwrappable_declarations << "\n";
+    std::cerr << "  bytes of Declarations: " << statistics::declaration_bytes << "\n";
+    std::cerr << "  declarations reachable from the inputs: " << statistics::reachable_declarations << "\n";
+    std::cerr << "  types translated: " << statistics::types
+              << ", plus " << statistics::sugared_types << " sugared types sharing them\n";
+    // Each reference used to be a copy of its own
+    std::cerr << "  bytes of names: " << statistics::interned_name_bytes
+              << " for " << statistics::name_references << " references to them, instead of "
+              << statistics::name_reference_bytes << "\n";
+    std::cerr << "  function bodies skipped: " << statistics::skipped_function_bodies << "\n";
+
+    // Comparing each declaration's file with each input file by path took
+    // two stat calls per pair.  Now each input file is looked up once per
+    // AST, which is at most one stat.
+    size_t path_comparisons = statistics::emit_filter_checks * statistics::input_files;
+    size_t stats_avoided = 2 * path_comparisons;
+    if (stats_avoided > statistics::emit_filter_file_lookups)
+    {
+        stats_avoided -= statistics::emit_filter_file_lookups;
+    }
+    else
+    {
+        stats_avoided = 0;
+    }
+    std::cerr << "  file system calls avoided by the emit filter: " << stats_avoided << "\n";
+}
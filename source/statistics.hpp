@@ -0,0 +1,53 @@
+/*
+ *  cpp_binder: an automatic C++ binding generator for D
+ *  Copyright (C) 2016 Paul O'Neil <redballoon36@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATISTICS_HPP__
+#define __STATISTICS_HPP__
+
+#include <cstddef>
+
+// Counters describing how much work the C++ half of a run did.
+// They are printed along with the D side's timings by --stats.
+namespace statistics
+{
+    extern size_t skipped_function_bodies;
+    extern size_t declarations;
+    extern size_t declaration_bytes;
+    extern size_t reachable_declarations;
+    // Skipped by the traversal, and wrapped later anyway
+    extern size_t deferred_declarations;
+    extern size_t materialized_declarations;
+    // Declarations whose traversal stopped because they cannot be wrapped
+    extern size_t unwrappable_declarations;
+    // Type objects allocated, and sugared types that share one of them
+    // instead of getting their own
+    extern size_t types;
+    extern size_t sugared_types;
+    // Names of declarations and types; see binder::intern
+    extern size_t name_references;
+    extern size_t name_reference_bytes;
+    extern size_t interned_name_bytes;
+    // For deciding which declarations come from the input files
+    extern size_t input_files;
+    extern size_t emit_filter_checks;
+    extern size_t emit_filter_file_lookups;
+}
+
+void printTraversalStatistics();
+
+#endif // __STATISTICS_HPP__
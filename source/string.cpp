@@ -18,143 +18,313 @@
 
 #include <string.h>
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
+#include "statistics.hpp"
 #include "string.hpp"
 using namespace binder;
 
 string::string()
-    : buffer(nullptr), length(0)
+    : buffer(inline_buffer), length(0), capacity(inline_capacity)
 {
-    buffer = new char[length + 1];
-    buffer[length] = 0;
+    buffer[0] = 0;
 }
 
 string::string(const char * str)
-    : buffer(nullptr), length(strlen(str))
-{
-    buffer = new char[length + 1];
-    strncpy(buffer, str, length);
-    buffer[length] = 0;
-}
+    : string(str, strlen(str))
+{ }
 
 string::string(const char * str, unsigned long len)
-    : buffer(nullptr), length(len)
+    : string()
 {
-    buffer = new char[length + 1];
-    strncpy(buffer, str, length);
-    buffer[length] = 0;
+    append(str, len);
 }
 
 string::string(const char * start, const char * end)
-    : buffer(nullptr), length(end - start)
-{
-    buffer = new char[length + 1];
-    strncpy(buffer, start, length);
-    buffer[length] = 0;
-}
+    : string(start, end - start)
+{ }
 
 string::string(const string& other)
-    : buffer(nullptr), length(other.length)
-{
-    buffer = new char[length + 1];
-    strncpy(buffer, other.buffer, length);
-    buffer[length] = 0;
-}
+    : string(other.buffer, other.length)
+{ }
+
 string::string(string&& other)
-    : buffer(other.buffer), length(other.length)
+    : string()
 {
-    other.buffer = nullptr;
+    *this = std::move(other);
 }
 
 string::string(size_t len)
-    : buffer(nullptr), length(len)
+    : string()
 {
-    buffer = new char[length + 1];
-    memset(buffer, 0, length + 1);
+    reserve(len);
+    memset(buffer, 0, len + 1);
+    length = len;
 }
+
 string::~string()
 {
-    if( buffer )
+    if( !isInline() )
     {
         delete []buffer;
     }
 }
 
+void string::becomeEmpty()
+{
+    buffer = inline_buffer;
+    length = 0;
+    capacity = inline_capacity;
+    buffer[0] = 0;
+}
+
 size_t string::size() const
 {
     return length;
 }
 
-/*size_t string::size() const
+char * string::begin()
 {
-    return length;
-}*/
-bool string::operator==(const string& other) const
+    return buffer;
+}
+
+char * string::end()
+{
+    return buffer + length;
+}
+
+char * string::c_str()
+{
+    return buffer;
+}
+const char * string::c_str() const
+{
+    return buffer;
+}
+
+void string::reserve(size_t new_capacity)
 {
-    if( length == other.length )
+    if( new_capacity <= capacity )
     {
-        return strncmp(buffer, other.buffer, length) == 0;
+        return;
     }
-    else {
-        return false;
+
+    char * new_buffer = new char[new_capacity + 1];
+    memcpy(new_buffer, buffer, length + 1);
+    if( !isInline() )
+    {
+        delete []buffer;
     }
+    buffer = new_buffer;
+    capacity = new_capacity;
 }
 
-bool string::operator!=(const string& other) const
+string& string::append(const char * str, size_t len)
 {
-    if( length == other.length )
+    if( length + len > capacity )
     {
-        return strncmp(buffer, other.buffer, length) != 0;
+        // Doubling keeps a run of appends linear overall
+        size_t new_capacity = std::max(length + len, 2 * capacity);
+        char * new_buffer = new char[new_capacity + 1];
+        memcpy(new_buffer, buffer, length);
+        // str may point into the old buffer, so it is freed afterwards
+        memcpy(new_buffer + length, str, len);
+        if( !isInline() )
+        {
+            delete []buffer;
+        }
+        buffer = new_buffer;
+        capacity = new_capacity;
     }
-    else {
-        return true;
+    else
+    {
+        memmove(buffer + length, str, len);
     }
+    length += len;
+    buffer[length] = 0;
+    return *this;
 }
 
-char * string::c_str()
+string& string::append(const string& other)
 {
-    return buffer;
+    return append(other.buffer, other.length);
 }
-const char * string::c_str() const
+
+bool string::operator==(const string& other) const
 {
-    return buffer;
+    return length == other.length && memcmp(buffer, other.buffer, length) == 0;
+}
+
+bool string::operator!=(const string& other) const
+{
+    return !(*this == other);
 }
 
 string string::operator+(const string& other) const
 {
-    string result(length + other.length);
-    strncpy(result.buffer, buffer, length);
-    strncpy(result.buffer + length, other.buffer, other.length);
-    return result;
+    string_builder result(length + other.length);
+    result.append(*this).append(other);
+    return result.finish();
 }
 
 string& string::operator=(const string& other)
 {
-    if( length != other.length )
+    if( this != &other )
     {
-        if( buffer )
-            delete []buffer;
-        length = other.length;
-        buffer = new char[length + 1];
+        length = 0;
+        append(other.buffer, other.length);
     }
-    strncpy(buffer, other.buffer, length);
-    buffer[length] = 0;
     return *this;
 }
 string& string::operator=(string&& other)
 {
-    if( buffer )
-        delete []buffer;
-    buffer = other.buffer;
-    other.buffer = nullptr;
-    length = other.length;
+    if( this == &other )
+    {
+        return *this;
+    }
+    if( other.isInline() )
+    {
+        length = 0;
+        append(other.buffer, other.length);
+    }
+    else
+    {
+        if( !isInline() )
+        {
+            delete []buffer;
+        }
+        buffer = other.buffer;
+        length = other.length;
+        capacity = other.capacity;
+    }
+    other.becomeEmpty();
     return *this;
 }
 
+string_builder& string_builder::append(const char * str)
+{
+    return append(str, strlen(str));
+}
+
 string* binder::toBinderString(const char*str, size_t len)
 {
     return new string(str, len);
 }
 
+// Defined here rather than in statistics.cpp so that this file stands alone
+size_t statistics::name_references = 0;
+size_t statistics::name_reference_bytes = 0;
+size_t statistics::interned_name_bytes = 0;
+
+size_t binder::hashChars(const char* chars, size_t len)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for( size_t idx = 0; idx < len; ++idx )
+    {
+        hash ^= static_cast<unsigned char>(chars[idx]);
+        hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+}
+
+namespace {
+// The characters of a name and their hash.  Lookups point one of these at
+// the caller's characters, so they don't have to build a string first.
+struct NameKey
+{
+    const char* chars;
+    size_t length;
+    size_t hash;
+
+    NameKey(const char* c, size_t len)
+        : chars(c), length(len), hash(hashChars(c, len))
+    { }
+};
+
+struct NameKeyHash
+{
+    size_t operator()(const NameKey& key) const
+    {
+        return key.hash;
+    }
+};
+
+struct NameKeyEqual
+{
+    bool operator()(const NameKey& left, const NameKey& right) const
+    {
+        return left.length == right.length
+            && memcmp(left.chars, right.chars, left.length) == 0;
+    }
+};
+
+struct InternTable
+{
+    // A deque never moves its elements, so the keys can point into them
+    std::deque<string> names;
+    std::unordered_map<NameKey, const string*, NameKeyHash, NameKeyEqual> by_chars;
+};
+} // anonymous namespace
+
+static InternTable& internTable()
+{
+    static InternTable table;
+    return table;
+}
+
+const string* binder::intern(const char* str, size_t len)
+{
+    statistics::name_references++;
+    statistics::name_reference_bytes += len + 1;
+
+    InternTable& table = internTable();
+    NameKey key(str, len);
+    auto search_result = table.by_chars.find(key);
+    if( search_result != table.by_chars.end() )
+    {
+        return search_result->second;
+    }
+
+    table.names.emplace_back(str, len);
+    const string* interned = &table.names.back();
+    key.chars = interned->c_str();
+    table.by_chars.insert(std::make_pair(key, interned));
+    statistics::interned_name_bytes += len + 1;
+    return interned;
+}
+
+const string* binder::intern(const string& str)
+{
+    return intern(str.c_str(), str.size());
+}
+
+const string* binder::findInterned(const char* str, size_t len)
+{
+    InternTable& table = internTable();
+    auto search_result = table.by_chars.find(NameKey(str, len));
+    if( search_result == table.by_chars.end() )
+    {
+        return nullptr;
+    }
+    return search_result->second;
+}
+
+const string* binder::findInterned(const string& str)
+{
+    return findInterned(str.c_str(), str.size());
+}
+
+const string* binder::emptyString()
+{
+    static const string* empty = intern("", 0);
+    return empty;
+}
+
 std::ostream& operator<<(std::ostream& output, const string& str)
 {
     return output << str.c_str();
@@ -19,14 +19,33 @@
 #ifndef __STRING_HPP__
 #define __STRING_HPP__
 
+#include <cstddef>
 #include <iostream>
+#include <functional>
+#include <utility>
 /* A simple non-templated string that I can bind easily */
 
 namespace binder {
+// Strings of up to inline_capacity characters, like most names, are stored
+// inside the object instead of on the heap.  Longer ones grow geometrically
+// as they are appended to.
+//
+// The accessors are defined out of line so that D can call them.
 class string
 {
+    static const size_t inline_capacity = 15;
+
     char * buffer;
     size_t length;
+    // Not counting the terminating NUL
+    size_t capacity;
+    char inline_buffer[inline_capacity + 1];
+
+    bool isInline() const
+    {
+        return buffer == inline_buffer;
+    }
+    void becomeEmpty();
 
     public:
     string();
@@ -38,20 +57,17 @@ class string
     string(string&&);
     ~string();
 
-    virtual size_t size() const;
-
-    virtual char * begin()
-    {
-        return buffer;
-    }
-
-    virtual char * end()
-    {
-        return buffer + length;
-    }
-    virtual char * c_str();
+    size_t size() const;
+    char * begin();
+    char * end();
+    char * c_str();
     const char * c_str() const;
 
+    // Makes room for new_capacity characters without reallocating
+    void reserve(size_t new_capacity);
+    string& append(const char * str, size_t len);
+    string& append(const string& other);
+
     bool operator==(const string& other) const;
     bool operator!=(const string& other) const;
 
@@ -62,11 +78,60 @@ class string
 
     void operator+=(const string& other)
     {
-        (*this) = (*this) + other;
+        append(other);
+    }
+};
+
+// For building a string out of many pieces, such as a qualified name,
+// in one buffer.
+class string_builder
+{
+    string result;
+
+    public:
+    explicit string_builder(size_t expected_length = 0)
+    {
+        result.reserve(expected_length);
+    }
+
+    string_builder& append(const char * str, size_t len)
+    {
+        result.append(str, len);
+        return *this;
+    }
+    string_builder& append(const char * str);
+    string_builder& append(const string& str)
+    {
+        result.append(str);
+        return *this;
+    }
+
+    size_t size() const
+    {
+        return result.size();
+    }
+
+    // Leaves the builder empty
+    string finish()
+    {
+        return std::move(result);
     }
 };
 
 string* toBinderString(const char* str, size_t len);
+
+// Names are interned: each distinct name is stored once for the rest of
+// the run, so two interned names are equal exactly when they are the
+// same pointer.
+const string* intern(const char* str, size_t len);
+const string* intern(const string& str);
+// The interned copy of str, or null if it has not been interned
+const string* findInterned(const char* str, size_t len);
+const string* findInterned(const string& str);
+const string* emptyString();
+
+// The hash the intern table uses, for other tables keyed by names
+size_t hashChars(const char* chars, size_t len);
 } // namespace binder
 
 namespace std {
@@ -75,8 +140,7 @@ struct hash<binder::string>
 {
     size_t operator()(const binder::string& str) const
     {
-        std::hash<std::string> hasher;
-        return hasher(str.c_str());
+        return binder::hashChars(str.c_str(), str.size());
     }
 };
 }
@@ -0,0 +1,7 @@
+struct Point
+{
+    int x;
+    int y;
+};
+
+int distance_from_origin();
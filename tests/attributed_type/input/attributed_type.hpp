@@ -0,0 +1 @@
+int count(int * _Nonnull);
@@ -0,0 +1,12 @@
+namespace lib
+{
+    int visible();
+    int debugDump();
+    int debugTrace();
+    int debugLog();
+
+    namespace detail
+    {
+        int helper();
+    }
+}